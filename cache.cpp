@@ -0,0 +1,447 @@
+/**
+ * Output cache of the cached prefix
+ *
+ * cached [dependencies...] -- pipeline stores the output of a pipeline that succeeded under a key that hashes
+ * everything the output depends on: the working directory, the arguments of every command, the identity of every
+ * executable and the input file and dependencies. Files up to CACHE_HASH_LIMIT are hashed by content, larger files and
+ * directories by their inode, size and modification time. A later line with the same key gets the stored output
+ * without running anything. The output redirection isn't part of the key, so the same pipeline can be written to
+ * different files. A pipeline that reads the STDIN of the shell instead of an input file is never served or stored.
+ *
+ * The store is a directory with one file per entry, named by the hex key. SHELL_CACHE_DIR sets it, the default is
+ * $XDG_CACHE_HOME/shell or ~/.cache/shell. Entries are written to a temporary file by the output pump and renamed when
+ * the pipeline succeeded, so a failed or killed pipeline never leaves a partial entry. A hit clones the entry into the
+ * output file when the file system supports reflinks, and copies it otherwise. A hit also sets the modification time of
+ * the entry, and when the store grows over SHELL_CACHE_SIZE bytes (default 256 MiB) the entries that were used longest
+ * ago are removed.
+ */
+
+#include "shell_internal.h"
+
+#include <algorithm>
+#include <iostream>
+#include <vector>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+CacheStats cacheStats;
+
+/**
+ * Files up to this size are hashed by content, larger ones by inode, size and modification time
+ */
+const off_t CACHE_HASH_LIMIT = 16 * 1024 * 1024;
+
+/**
+ * Default size limit of the store in bytes
+ */
+const off_t CACHE_SIZE = 256 * 1024 * 1024;
+
+/**
+ * Temporary files older than this many seconds belong to a shell that died, eviction removes them
+ */
+const time_t CACHE_STALE_TEMP = 60 * 60;
+
+static const uint32_t SHA256_K[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline uint32_t rotr(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+Sha256::Sha256() : state{0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab,
+                         0x5be0cd19}, length(0), buffer(), used(0) {}
+
+void Sha256::block(const unsigned char *p) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = uint32_t(p[4 * i]) << 24 | uint32_t(p[4 * i + 1]) << 16 | uint32_t(p[4 * i + 2]) << 8 | p[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + SHA256_K[i] + w[i];
+        uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+void Sha256::update(const void *data, size_t len) {
+    auto *p = static_cast<const unsigned char *>(data);
+    length += len;
+    if (used > 0) {
+        size_t take = std::min(len, sizeof(buffer) - used);
+        memcpy(buffer + used, p, take);
+        used += take;
+        p += take;
+        len -= take;
+        if (used < sizeof(buffer)) {
+            return;
+        }
+        block(buffer);
+        used = 0;
+    }
+    for (; len >= sizeof(buffer); p += sizeof(buffer), len -= sizeof(buffer)) {
+        block(p);
+    }
+    memcpy(buffer, p, len);
+    used = len;
+}
+
+void Sha256::update(const std::string &str) {
+    // The terminating NUL separates fields, so "ab" "c" and "a" "bc" hash differently
+    update(str.c_str(), str.size() + 1);
+}
+
+std::string Sha256::hex() {
+    uint64_t bits = length * 8;
+    unsigned char pad[72] = {0x80};
+    size_t padding = (used < 56 ? 56 : 120) - used;
+    for (int i = 0; i < 8; i++) {
+        pad[padding + i] = static_cast<unsigned char>(bits >> (56 - 8 * i));
+    }
+    update(pad, padding + 8);
+    static const char digits[] = "0123456789abcdef";
+    std::string result;
+    for (uint32_t word : state) {
+        for (int shift = 28; shift >= 0; shift -= 4) {
+            result += digits[(word >> shift) & 0xf];
+        }
+    }
+    return result;
+}
+
+/**
+ * Adds what a file's content depends on to a hash: the content for regular files up to limit bytes, the inode, size
+ * and modification time for everything else, or a marker if the file doesn't exist
+ */
+static void hashFile(Sha256 &hash, const char *path, off_t limit) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        hash.update(std::string("missing"));
+        return;
+    }
+    if (S_ISREG(st.st_mode) && st.st_size <= limit) {
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd != -1) {
+            hash.update(std::string("content"));
+            char buf[65536];
+            ssize_t got;
+            while ((got = read(fd, buf, sizeof(buf))) > 0) {
+                hash.update(buf, static_cast<size_t>(got));
+            }
+            close(fd);
+            if (got == 0) {
+                return;
+            }
+            // A read error leaves a partial hash, the stat identity below still makes the key unique
+        }
+    }
+    hash.update(std::string("stat"));
+    hash.update(std::to_string(st.st_dev) + ":" + std::to_string(st.st_ino) + ":" + std::to_string(st.st_size) + ":" +
+                std::to_string(st.st_mtim.tv_sec) + "." + std::to_string(st.st_mtim.tv_nsec));
+}
+
+/**
+ * Computes the cache key of a planned pipeline
+ * @param plan the plan of command, gives the resolved executables
+ * @param command first command of the pipeline, with the prefixes removed
+ * @param dependencies files the output depends on besides the input file
+ * @return the key as 64 hex digits
+ */
+std::string cacheKey(ExecutionPlan *plan, Command *command, const std::vector<std::string> &dependencies) {
+    Sha256 hash;
+    hash.update(std::string("shell cache 1"));
+    char cwd[4096];
+    hash.update(std::string(getcwd(cwd, sizeof(cwd)) != nullptr ? cwd : ""));
+    for (Stage &stage : plan->stages) {
+        if (stage.native != nullptr) {
+            hash.update(std::string("native"));
+        } else {
+            // Executables are identified by their inode and modification time, hashing them costs too much
+            hash.update(std::string(stage.path));
+            hashFile(hash, stage.path, -1);
+        }
+        for (char **arg = stage.argv; *arg != nullptr; arg++) {
+            hash.update(std::string(*arg));
+        }
+        hash.update(std::string("|"));
+    }
+    if (command->redir_in != nullptr) {
+        hash.update(std::string("<"));
+        hashFile(hash, command->redir_in, CACHE_HASH_LIMIT);
+    }
+    for (const std::string &dependency : dependencies) {
+        hash.update(dependency);
+        hashFile(hash, dependency.c_str(), CACHE_HASH_LIMIT);
+    }
+    return hash.hex();
+}
+
+/**
+ * Creates a directory and its parents
+ */
+static bool makeDirs(const std::string &path) {
+    for (size_t slash = path.find('/', 1); slash != std::string::npos; slash = path.find('/', slash + 1)) {
+        mkdir(path.substr(0, slash).c_str(), S_IRWXU);
+    }
+    return mkdir(path.c_str(), S_IRWXU) == 0 || errno == EEXIST;
+}
+
+/**
+ * Finds the store directory and creates it if needed
+ * @return the directory, or an empty string if it can't be created, an error has been printed then
+ */
+std::string cacheDir() {
+    std::string dir;
+    const char *env = getenv("SHELL_CACHE_DIR");
+    if (env != nullptr && *env != '\0') {
+        dir = env;
+    } else if ((env = getenv("XDG_CACHE_HOME")) != nullptr && *env != '\0') {
+        dir = std::string(env) + "/shell";
+    } else if ((env = getenv("HOME")) != nullptr) {
+        dir = std::string(env) + "/.cache/shell";
+    } else {
+        std::cerr << "cached: no cache directory, set SHELL_CACHE_DIR" << std::endl;
+        return std::string();
+    }
+    if (!makeDirs(dir)) {
+        perror(dir.c_str());
+        return std::string();
+    }
+    return dir;
+}
+
+/**
+ * The size limit of the store from SHELL_CACHE_SIZE, in bytes with an optional K, M or G suffix
+ */
+off_t cacheLimit() {
+    const char *env = getenv("SHELL_CACHE_SIZE");
+    if (env == nullptr) {
+        return CACHE_SIZE;
+    }
+    char *end;
+    long long size = strtoll(env, &end, 10);
+    switch (*end) {
+        case 'G':
+            size *= 1024;
+            // fall through
+        case 'M':
+            size *= 1024;
+            // fall through
+        case 'K':
+            size *= 1024;
+            break;
+        default:
+            break;
+    }
+    return size > 0 ? static_cast<off_t>(size) : CACHE_SIZE;
+}
+
+/**
+ * Copies everything from in to out, with copy_file_range() when both are files and read() and write() otherwise
+ */
+static bool copyAll(int in, int out) {
+    ssize_t got;
+    bool copied = false;
+    while ((got = copy_file_range(in, nullptr, out, nullptr, 1 << 30, 0)) > 0) {
+        copied = true;
+    }
+    if (got == 0) {
+        return true;
+    }
+    if (copied) {
+        return false;
+    }
+    char buf[65536];
+    while ((got = read(in, buf, sizeof(buf))) > 0) {
+        if (!writeAll(out, buf, static_cast<size_t>(got))) {
+            return false;
+        }
+    }
+    return got == 0;
+}
+
+/**
+ * Writes a stored entry to the output of the pipeline, instead of running it
+ * @param dir the store
+ * @param key key of the pipeline
+ * @param last last command of the pipeline, gives the output redirection
+ * @param stdout_fd output when there is no output redirection
+ * @param written set to whether the whole entry reached the output, when there is an entry
+ * @return false if there is no entry for key
+ */
+bool serveCached(const std::string &dir, const std::string &key, Command *last, int stdout_fd, bool &written) {
+    int entry = open((dir + "/" + key).c_str(), O_RDONLY | O_CLOEXEC);
+    if (entry == -1) {
+        cacheStats.misses++;
+        return false;
+    }
+    struct stat st;
+    fstat(entry, &st);
+    futimens(entry, nullptr); // Marks the entry as used for eviction
+    cacheStats.hits++;
+    cacheStats.bytes_served += static_cast<unsigned long long>(st.st_size);
+    int out = last->redir_out != nullptr ? openRedirOut(last) : stdout_fd;
+    written = out != -1;
+    if (out != -1) {
+        // Appending can't share extents with the entry, a truncated output file can
+        if ((last->redir_out == nullptr || last->append || ioctl(out, FICLONE, entry) != 0) && !copyAll(entry, out)) {
+            perror("cached");
+            written = false;
+        }
+        if (last->redir_out != nullptr) {
+            close(out);
+        }
+    }
+    close(entry);
+    return true;
+}
+
+/**
+ * Creates the temporary file the output pump copies the output of a pipeline to
+ * @param dir the store
+ * @param path receives the path of the file
+ * @return the file descriptor, -1 if the file can't be created
+ */
+int createCacheEntry(const std::string &dir, std::string &path) {
+    path = dir + "/.tmp.XXXXXX";
+    int fd = mkostemp(&path[0], O_CLOEXEC);
+    if (fd == -1) {
+        perror("cached");
+        path.clear();
+    }
+    return fd;
+}
+
+/**
+ * Removes the entries that were used longest ago until the store is at most limit bytes, and temporary files of
+ * shells that died
+ * @param dir the store
+ * @param limit size limit in bytes
+ */
+void evictCache(const std::string &dir, off_t limit) {
+    DIR *d = opendir(dir.c_str());
+    if (d == nullptr) {
+        return;
+    }
+    struct Entry {
+        struct timespec used;
+        std::string name;
+        off_t size;
+    };
+    std::vector<Entry> entries;
+    off_t total = 0;
+    time_t now = time(nullptr);
+    struct dirent *ent;
+    while ((ent = readdir(d)) != nullptr) {
+        struct stat st;
+        if (fstatat(dirfd(d), ent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        if (ent->d_name[0] == '.') {
+            if (now - st.st_mtime > CACHE_STALE_TEMP) {
+                unlinkat(dirfd(d), ent->d_name, 0);
+            }
+            continue;
+        }
+        entries.push_back(Entry{st.st_mtim, ent->d_name, st.st_size});
+        total += st.st_size;
+    }
+    closedir(d);
+    std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) {
+        return a.used.tv_sec != b.used.tv_sec ? a.used.tv_sec < b.used.tv_sec : a.used.tv_nsec < b.used.tv_nsec;
+    });
+    for (size_t i = 0; total > limit && i < entries.size(); i++) {
+        if (unlink((dir + "/" + entries[i].name).c_str()) == 0) {
+            total -= entries[i].size;
+            cacheStats.evictions++;
+        }
+    }
+}
+
+/**
+ * Turns the temporary file into the entry for key when the pipeline succeeded, or removes it
+ * @param dir the store
+ * @param path the temporary file
+ * @param key key of the pipeline
+ * @param success whether the pipeline and the output pump succeeded
+ */
+void finishCacheEntry(const std::string &dir, const std::string &path, const std::string &key, bool success) {
+    if (!success) {
+        unlink(path.c_str());
+        return;
+    }
+    if (rename(path.c_str(), (dir + "/" + key).c_str()) != 0) {
+        perror("cached");
+        unlink(path.c_str());
+        return;
+    }
+    cacheStats.stores++;
+    evictCache(dir, cacheLimit());
+}
+
+/**
+ * Writes the statistics of this shell and the size of the store, one "name value" pair per line
+ */
+void printCacheStats(std::ostream &out) {
+    unsigned long entries = 0;
+    unsigned long long bytes = 0;
+    std::string dir = cacheDir();
+    DIR *d = dir.empty() ? nullptr : opendir(dir.c_str());
+    if (d != nullptr) {
+        struct dirent *ent;
+        while ((ent = readdir(d)) != nullptr) {
+            struct stat st;
+            if (ent->d_name[0] != '.' && fstatat(dirfd(d), ent->d_name, &st, 0) == 0 && S_ISREG(st.st_mode)) {
+                entries++;
+                bytes += static_cast<unsigned long long>(st.st_size);
+            }
+        }
+        closedir(d);
+    }
+    out << "hits " << cacheStats.hits << "\n"
+        << "misses " << cacheStats.misses << "\n"
+        << "stores " << cacheStats.stores << "\n"
+        << "evictions " << cacheStats.evictions << "\n"
+        << "bytes_served " << cacheStats.bytes_served << "\n"
+        << "entries " << entries << "\n"
+        << "bytes " << bytes << "\n"
+        << "limit " << cacheLimit() << "\n";
+}
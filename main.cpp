@@ -1,4 +1,4 @@
-extern int shell(bool prompt);
+#include "shell_internal.h"
 
 int main(int argc, char** argv) {
     bool showPrompt = argc == 1;
@@ -0,0 +1,260 @@
+/**
+ * Runtime metrics of the shell
+ *
+ * The counters and histograms live in one shared anonymous mapping that is created before the first fork, so the
+ * children update the same numbers as the shell: the output pump counts the bytes it writes and a child that can't
+ * execve() counts the failure. Every update is a relaxed atomic add, cheap enough to always be on.
+ *
+ * Latencies go into histograms with buckets like HdrHistogram: values are microseconds, and every power of two range
+ * is split into HISTOGRAM_SUB_BUCKETS linear buckets, so the error of a bucket is at most 1/16 of its value. No
+ * latency is too long or too short to be recorded, and recording is a count leading zeros and two adds.
+ *
+ * The stats builtin prints the metrics in the Prometheus text format. With SHELL_METRICS_FILE set they are also
+ * written to that file every SHELL_METRICS_INTERVAL seconds (default 10), for the node exporter textfile collector for
+ * example. The file is replaced with rename(), so readers never see half of it. The shell has no threads, because the
+ * children run code between fork() and execve(), so a timerfd tells when the file is due. shell() writes the file at
+ * startup and waits for the timer together with its input, waitPlan together with the stages, so the file stays fresh
+ * while the shell is idle and while a long pipeline runs.
+ */
+
+#include "shell_internal.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+
+/**
+ * Seconds between writes of the metrics file when SHELL_METRICS_INTERVAL isn't set
+ */
+const long METRICS_INTERVAL = 10;
+
+/**
+ * @return the metrics, mapped on the first call
+ */
+Metrics &metrics() {
+    static Metrics *shared = nullptr;
+    if (shared == nullptr) {
+        void *mapping = mmap(nullptr, sizeof(Metrics), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (mapping == MAP_FAILED) {
+            // Without shared memory only the counts of the shell process itself are kept
+            static Metrics local;
+            shared = &local;
+        } else {
+            shared = new(mapping) Metrics();
+        }
+    }
+    return *shared;
+}
+
+/**
+ * Adds to a counter, also from forked children
+ */
+void addMetric(unsigned long long &counter, unsigned long long value) {
+    __atomic_fetch_add(&counter, value, __ATOMIC_RELAXED);
+}
+
+/**
+ * @return microseconds on the monotonic clock
+ */
+long monotonicMicros() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000L + now.tv_nsec / 1000L;
+}
+
+/**
+ * @param value a latency in microseconds
+ * @return the bucket of value: values below HISTOGRAM_SUB_BUCKETS have their own bucket, above that the top
+ *         HISTOGRAM_SUB_BITS + 1 bits select it
+ */
+size_t histogramIndex(unsigned long long value) {
+    if (value < HISTOGRAM_SUB_BUCKETS) {
+        return static_cast<size_t>(value);
+    }
+    int exponent = 63 - __builtin_clzll(value);
+    int shift = exponent - HISTOGRAM_SUB_BITS;
+    size_t index = static_cast<size_t>(shift + 1) * HISTOGRAM_SUB_BUCKETS +
+                   ((value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1));
+    return std::min(index, HISTOGRAM_BUCKETS - 1);
+}
+
+/**
+ * @param index a bucket
+ * @return the largest value that goes into the bucket
+ */
+unsigned long long histogramUpperBound(size_t index) {
+    if (index < HISTOGRAM_SUB_BUCKETS) {
+        return index;
+    }
+    int shift = static_cast<int>(index / HISTOGRAM_SUB_BUCKETS) - 1;
+    unsigned long long sub = index % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS;
+    return ((sub + 1) << shift) - 1;
+}
+
+/**
+ * Adds a latency to a histogram
+ * @param histogram the histogram
+ * @param micros latency in microseconds, negative values count as 0
+ */
+void recordLatency(Histogram &histogram, long micros) {
+    unsigned long long value = micros > 0 ? static_cast<unsigned long long>(micros) : 0;
+    addMetric(histogram.buckets[histogramIndex(value)], 1);
+    addMetric(histogram.count, 1);
+    addMetric(histogram.sum, value);
+}
+
+/**
+ * @return number of open file descriptors of the shell
+ */
+static long openFds() {
+    DIR *dir = opendir("/proc/self/fd");
+    if (dir == nullptr) {
+        return -1;
+    }
+    long count = 0;
+    while (struct dirent *ent = readdir(dir)) {
+        if (ent->d_name[0] != '.') {
+            count++;
+        }
+    }
+    closedir(dir);
+    return count - 1; // The descriptor of dir itself
+}
+
+/**
+ * Prints one counter or gauge with its HELP and TYPE lines
+ */
+static void printMetric(std::ostream &out, const char *name, const char *type, const char *help,
+                        unsigned long long value) {
+    out << "# HELP " << name << " " << help << "\n"
+        << "# TYPE " << name << " " << type << "\n"
+        << name << " " << value << "\n";
+}
+
+/**
+ * Prints a histogram. Only buckets that have values get a line, Prometheus only needs the upper bounds to be
+ * cumulative, and a few hundred empty buckets per scrape would be noise.
+ */
+static void printHistogram(std::ostream &out, const char *name, const char *help, const Histogram &histogram) {
+    out << "# HELP " << name << " " << help << "\n"
+        << "# TYPE " << name << " histogram\n";
+    unsigned long long cumulative = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        unsigned long long bucket = __atomic_load_n(&histogram.buckets[i], __ATOMIC_RELAXED);
+        if (bucket == 0) {
+            continue;
+        }
+        cumulative += bucket;
+        out << name << "_bucket{le=\"" << std::fixed << std::setprecision(6) << histogramUpperBound(i) / 1e6
+            << "\"} " << cumulative << "\n";
+    }
+    out << name << "_bucket{le=\"+Inf\"} " << cumulative << "\n"
+        << name << "_sum " << std::fixed << std::setprecision(6) << histogram.sum / 1e6 << "\n"
+        << name << "_count " << cumulative << "\n";
+}
+
+/**
+ * Writes all metrics in the Prometheus text format
+ */
+void printMetrics(std::ostream &out) {
+    Metrics &m = metrics();
+    printMetric(out, "shell_lines_total", "counter", "Command lines executed.", m.lines);
+    printMetric(out, "shell_parse_errors_total", "counter", "Command lines with a syntax error.", m.parse_errors);
+    printMetric(out, "shell_builtins_total", "counter", "Builtins executed.", m.builtins);
+    printMetric(out, "shell_forks_total", "counter", "Processes forked for stages and output pumps.", m.forks);
+    printMetric(out, "shell_exec_failures_total", "counter", "Commands that could not be found or executed.",
+                m.exec_failures);
+    out << "# HELP shell_output_bytes_total Bytes the output pump copied, by target.\n"
+        << "# TYPE shell_output_bytes_total counter\n"
+        << "shell_output_bytes_total{target=\"file\"} " << m.redirected_bytes << "\n"
+        << "shell_output_bytes_total{target=\"stdout\"} " << m.stdout_bytes << "\n";
+    printMetric(out, "shell_cache_hits_total", "counter", "Cached pipelines served from the store.", cacheStats.hits);
+    printMetric(out, "shell_cache_misses_total", "counter", "Cached pipelines that had to run.", cacheStats.misses);
+    printMetric(out, "shell_live_jobs", "gauge", "Pipelines that are running, in the foreground or background.",
+                m.foreground_jobs + liveBackgroundJobs());
+    long fds = openFds();
+    if (fds >= 0) {
+        printMetric(out, "shell_open_fds", "gauge", "Open file descriptors of the shell.",
+                    static_cast<unsigned long long>(fds));
+    }
+    printHistogram(out, "shell_line_duration_seconds", "Time from reading a command line to its completion.",
+                   m.line_latency);
+    printHistogram(out, "shell_stage_duration_seconds", "Time from fork to exit of pipeline stages.",
+                   m.stage_latency);
+}
+
+/**
+ * Creates the timer for the metrics file on the first call. shell() calls it at startup, programs that embed the shell
+ * get it with their first line.
+ * @return a timerfd that becomes readable when the metrics file is due, -1 if SHELL_METRICS_FILE isn't set
+ */
+int metricsTimer() {
+    static int timer = -2;
+    if (timer != -2) {
+        return timer;
+    }
+    timer = -1;
+    const char *file = getenv("SHELL_METRICS_FILE");
+    if (file == nullptr || *file == '\0') {
+        return timer;
+    }
+    const char *env = getenv("SHELL_METRICS_INTERVAL");
+    long interval = env != nullptr ? atol(env) : METRICS_INTERVAL;
+    timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer == -1) {
+        perror("metrics");
+        return timer;
+    }
+    struct itimerspec spec = {};
+    spec.it_interval.tv_sec = interval > 0 ? interval : METRICS_INTERVAL;
+    spec.it_value = spec.it_interval;
+    timerfd_settime(timer, 0, &spec, nullptr);
+    return timer;
+}
+
+/**
+ * Writes the metrics file if the timer has expired, without blocking
+ */
+void exportMetricsIfDue() {
+    int timer = metricsTimer();
+    uint64_t expirations;
+    if (timer != -1 && read(timer, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+        exportMetrics();
+    }
+}
+
+/**
+ * Writes the metrics file now, if SHELL_METRICS_FILE is set
+ */
+void exportMetrics() {
+    const char *file = getenv("SHELL_METRICS_FILE");
+    if (file == nullptr || *file == '\0') {
+        return;
+    }
+    std::ostringstream text;
+    printMetrics(text);
+    std::string path = file;
+    std::string temp = path + ".tmp";
+    int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd == -1) {
+        perror(temp.c_str());
+        return;
+    }
+    bool written = writeAll(fd, text.str().data(), text.str().size());
+    close(fd);
+    if (!written || rename(temp.c_str(), path.c_str()) != 0) {
+        perror(path.c_str());
+        unlink(temp.c_str());
+    }
+}
@@ -0,0 +1,447 @@
+/**
+ * Native pipeline stages
+ *
+ * head -n, tail -n and wc -l are so common in pipelines that the shell runs them itself in the forked child instead of
+ * executing coreutils. Their output is byte-identical to coreutils. Newlines are counted with SIMD over large read
+ * buffers: SSE2 is always available on x86-64, AVX2 is used when the CPU has it. Other architectures use memchr().
+ *
+ * head exits as soon as it has written its lines, so the stages before it get SIGPIPE right away. tail seeks from the
+ * end when its input is a regular file and only keeps the last lines in memory when it reads from a pipe.
+ *
+ * Only the forms head, head -n N, head -nN (and the same for tail) and wc -l reading from STDIN are native. Everything
+ * else, or an explicit path like /usr/bin/head, runs the real program.
+ */
+
+#include "shell_internal.h"
+
+#include <algorithm>
+#include <deque>
+#include <vector>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+/**
+ * Size of the buffers the native stages read with
+ */
+const size_t NATIVE_BUFFER = 128 * 1024;
+
+#if defined(__x86_64__)
+
+/**
+ * Counts newlines 32 bytes at a time. The compare results are -1 per matching byte, they are subtracted from byte
+ * counters that are summed with a SAD every 255 blocks, before they can overflow.
+ */
+__attribute__((target("avx2")))
+size_t countNewlinesAvx2(const char *buf, size_t len) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    size_t count = 0;
+    size_t i = 0;
+    while (i + 32 <= len) {
+        __m256i counters = _mm256_setzero_si256();
+        for (size_t block = 0; block < 255 && i + 32 <= len; block++, i += 32) {
+            __m256i data = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(buf + i));
+            counters = _mm256_sub_epi8(counters, _mm256_cmpeq_epi8(data, newline));
+        }
+        __m256i sums = _mm256_sad_epu8(counters, _mm256_setzero_si256());
+        count += _mm256_extract_epi64(sums, 0) + _mm256_extract_epi64(sums, 1) +
+                 _mm256_extract_epi64(sums, 2) + _mm256_extract_epi64(sums, 3);
+    }
+    for (; i < len; i++) {
+        count += buf[i] == '\n';
+    }
+    return count;
+}
+
+/**
+ * Same as countNewlinesAvx2, 16 bytes at a time with SSE2
+ */
+size_t countNewlinesSse2(const char *buf, size_t len) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    size_t count = 0;
+    size_t i = 0;
+    while (i + 16 <= len) {
+        __m128i counters = _mm_setzero_si128();
+        for (size_t block = 0; block < 255 && i + 16 <= len; block++, i += 16) {
+            __m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i *>(buf + i));
+            counters = _mm_sub_epi8(counters, _mm_cmpeq_epi8(data, newline));
+        }
+        __m128i sums = _mm_sad_epu8(counters, _mm_setzero_si128());
+        count += _mm_cvtsi128_si64(sums) + _mm_cvtsi128_si64(_mm_unpackhi_epi64(sums, sums));
+    }
+    for (; i < len; i++) {
+        count += buf[i] == '\n';
+    }
+    return count;
+}
+
+/**
+ * @return bit i is set if buf[i] is a newline, for 16 bytes
+ */
+inline unsigned newlineMask(const char *buf) {
+    __m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i *>(buf));
+    return static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(data, _mm_set1_epi8('\n'))));
+}
+
+#endif
+
+/**
+ * Counts the newlines in a buffer
+ * @param buf the buffer
+ * @param len length of the buffer
+ * @return number of newlines
+ */
+size_t countNewlines(const char *buf, size_t len) {
+#if defined(__x86_64__)
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    return avx2 ? countNewlinesAvx2(buf, len) : countNewlinesSse2(buf, len);
+#else
+    size_t count = 0;
+    const char *end = buf + len;
+    while ((buf = static_cast<const char *>(memchr(buf, '\n', end - buf))) != nullptr) {
+        count++;
+        buf++;
+    }
+    return count;
+#endif
+}
+
+/**
+ * Finds the n-th newline in a buffer
+ * @param buf the buffer
+ * @param len length of the buffer
+ * @param n number of the newline to find, starting at 1. If the buffer has fewer newlines, they are subtracted from n.
+ * @return pointer just after the n-th newline, nullptr if the buffer has fewer
+ */
+const char *findNewlines(const char *buf, size_t len, size_t &n) {
+    size_t i = 0;
+#if defined(__x86_64__)
+    for (; i + 16 <= len; i += 16) {
+        unsigned mask = newlineMask(buf + i);
+        size_t found = static_cast<size_t>(__builtin_popcount(mask));
+        if (found < n) {
+            n -= found;
+            continue;
+        }
+        for (; n > 1; n--) {
+            mask &= mask - 1; // Clear the lowest newline
+        }
+        n = 0;
+        return buf + i + __builtin_ctz(mask) + 1;
+    }
+#endif
+    for (; i < len; i++) {
+        if (buf[i] == '\n' && --n == 0) {
+            return buf + i + 1;
+        }
+    }
+    return nullptr;
+}
+
+/**
+ * Finds the n-th newline in a buffer, counting from the end
+ * @param buf the buffer
+ * @param len length of the buffer
+ * @param n number of the newline to find, starting at 1. If the buffer has fewer newlines, they are subtracted from n.
+ * @return pointer to the n-th newline from the end, nullptr if the buffer has fewer
+ */
+const char *findNewlinesReverse(const char *buf, size_t len, size_t &n) {
+    size_t i = len;
+#if defined(__x86_64__)
+    for (; i >= 16; i -= 16) {
+        unsigned mask = newlineMask(buf + i - 16);
+        size_t found = static_cast<size_t>(__builtin_popcount(mask));
+        if (found < n) {
+            n -= found;
+            continue;
+        }
+        for (; n > 1; n--) {
+            mask &= ~(1u << (31 - __builtin_clz(mask))); // Clear the highest newline
+        }
+        n = 0;
+        return buf + i - 16 + (31 - __builtin_clz(mask));
+    }
+#endif
+    while (i > 0) {
+        i--;
+        if (buf[i] == '\n' && --n == 0) {
+            return buf + i;
+        }
+    }
+    return nullptr;
+}
+
+/**
+ * read() that retries when interrupted
+ */
+ssize_t readSome(int fd, char *buf, size_t len) {
+    ssize_t got;
+    do {
+        got = read(fd, buf, len);
+    } while (got == -1 && errno == EINTR);
+    return got;
+}
+
+/**
+ * Writes the whole buffer to fd
+ * @return false if writing failed
+ */
+bool writeAll(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, buf, len);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buf += written;
+        len -= static_cast<size_t>(written);
+    }
+    return true;
+}
+
+/**
+ * head -n count: copies the first count lines from STDIN to STDOUT and exits. When STDIN is seekable it is left just
+ * after the last line that was copied, like coreutils does.
+ * @param count number of lines
+ * @return exit status
+ */
+int nativeHead(long count) {
+    size_t n = static_cast<size_t>(count);
+    if (n == 0) {
+        return 0;
+    }
+    std::vector<char> buffer(NATIVE_BUFFER);
+    char *buf = buffer.data();
+    for (;;) {
+        ssize_t got = readSome(STDIN_FILENO, buf, NATIVE_BUFFER);
+        if (got == -1) {
+            perror("head: read");
+            return 1;
+        }
+        if (got == 0) {
+            return 0;
+        }
+        const char *end = findNewlines(buf, static_cast<size_t>(got), n);
+        size_t len = end != nullptr ? static_cast<size_t>(end - buf) : static_cast<size_t>(got);
+        if (!writeAll(STDOUT_FILENO, buf, len)) {
+            perror("head: write");
+            return 1;
+        }
+        if (end != nullptr) {
+            lseek(STDIN_FILENO, -(got - static_cast<ssize_t>(len)), SEEK_CUR);
+            return 0;
+        }
+    }
+}
+
+/**
+ * Finds where the last n lines of a buffer start, a newline at the very end of the input doesn't start a new line
+ * @param buf the buffer
+ * @param len length of the buffer
+ * @param n number of lines, what isn't found in the buffer is subtracted
+ * @param at_end set if the buffer ends where the input ends
+ * @return offset of the first byte to output, or -1 if the buffer has fewer lines
+ */
+ssize_t lastLines(const char *buf, size_t len, size_t &n, bool at_end) {
+    if (at_end && len > 0 && buf[len - 1] == '\n') {
+        len--;
+    }
+    const char *newline = findNewlinesReverse(buf, len, n);
+    return newline != nullptr ? newline - buf + 1 : -1;
+}
+
+/**
+ * tail -n count for a regular file: reads blocks backwards from the end until count lines are found, then copies
+ * them to STDOUT
+ * @param count number of lines
+ * @param start offset of STDIN, where the file starts for tail
+ * @param size size of the file
+ * @return exit status
+ */
+int nativeTailFile(size_t count, off_t start, off_t size) {
+    std::vector<char> buffer(NATIVE_BUFFER);
+    char *buf = buffer.data();
+    size_t n = count;
+    off_t from = start;
+    off_t pos = size;
+    while (pos > start) {
+        size_t len = static_cast<size_t>(std::min(static_cast<off_t>(NATIVE_BUFFER), pos - start));
+        pos -= static_cast<off_t>(len);
+        if (pread(STDIN_FILENO, buf, len, pos) != static_cast<ssize_t>(len)) {
+            perror("tail: read");
+            return 1;
+        }
+        ssize_t found = lastLines(buf, len, n, pos + static_cast<off_t>(len) == size);
+        if (found != -1) {
+            from = pos + found;
+            break;
+        }
+    }
+    while (from < size) {
+        size_t len = static_cast<size_t>(std::min(static_cast<off_t>(NATIVE_BUFFER), size - from));
+        ssize_t got = pread(STDIN_FILENO, buf, len, from);
+        if (got <= 0) {
+            if (got == -1 && errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (!writeAll(STDOUT_FILENO, buf, static_cast<size_t>(got))) {
+            perror("tail: write");
+            return 1;
+        }
+        from += got;
+    }
+    return 0;
+}
+
+/**
+ * tail -n count for a pipe: keeps reading chunks and drops the oldest ones once the others hold more than count
+ * newlines, at the end the last count lines are in the remaining chunks. Reads go into the free space of the newest
+ * chunk, so a producer that writes one line at a time doesn't cost a buffer per line.
+ * @param count number of lines
+ * @return exit status
+ */
+int nativeTailPipe(size_t count) {
+    struct Chunk {
+        std::vector<char> data;
+        size_t used;
+        size_t newlines;
+    };
+    std::deque<Chunk> chunks;
+    size_t newlines = 0;
+    for (;;) {
+        if (chunks.empty() || chunks.back().used == NATIVE_BUFFER) {
+            chunks.push_back(Chunk{std::vector<char>(NATIVE_BUFFER), 0, 0});
+        }
+        Chunk &chunk = chunks.back();
+        ssize_t got = readSome(STDIN_FILENO, chunk.data.data() + chunk.used, NATIVE_BUFFER - chunk.used);
+        if (got == -1) {
+            perror("tail: read");
+            return 1;
+        }
+        if (got == 0) {
+            break;
+        }
+        size_t found = countNewlines(chunk.data.data() + chunk.used, static_cast<size_t>(got));
+        chunk.used += static_cast<size_t>(got);
+        chunk.newlines += found;
+        newlines += found;
+        while (chunks.size() > 1 && newlines - chunks.front().newlines > count) {
+            newlines -= chunks.front().newlines;
+            chunks.pop_front();
+        }
+    }
+    std::vector<char> data;
+    for (Chunk &chunk : chunks) {
+        data.insert(data.end(), chunk.data.begin(), chunk.data.begin() + static_cast<ssize_t>(chunk.used));
+    }
+    size_t n = count;
+    ssize_t from = lastLines(data.data(), data.size(), n, true);
+    if (from == -1) {
+        from = 0;
+    }
+    if (!writeAll(STDOUT_FILENO, data.data() + from, data.size() - static_cast<size_t>(from))) {
+        perror("tail: write");
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * tail -n count: copies the last count lines from STDIN to STDOUT
+ * @param count number of lines
+ * @return exit status
+ */
+int nativeTail(long count) {
+    if (count == 0) {
+        return 0;
+    }
+    struct stat st;
+    off_t start;
+    if (fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode) && (start = lseek(STDIN_FILENO, 0, SEEK_CUR)) != -1) {
+        return start < st.st_size ? nativeTailFile(static_cast<size_t>(count), start, st.st_size) : 0;
+    }
+    return nativeTailPipe(static_cast<size_t>(count));
+}
+
+/**
+ * wc -l: counts the newlines on STDIN
+ * @param count unused
+ * @return exit status
+ */
+int nativeWc(long) {
+    std::vector<char> buffer(NATIVE_BUFFER);
+    size_t lines = 0;
+    for (;;) {
+        ssize_t got = readSome(STDIN_FILENO, buffer.data(), NATIVE_BUFFER);
+        if (got == -1) {
+            perror("wc: read");
+            return 1;
+        }
+        if (got == 0) {
+            break;
+        }
+        lines += countNewlines(buffer.data(), static_cast<size_t>(got));
+    }
+    std::string out = std::to_string(lines) + "\n";
+    if (!writeAll(STDOUT_FILENO, out.data(), out.size())) {
+        perror("wc: write");
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Parses a line count for head and tail, only plain decimal numbers are accepted
+ * @return the count, -1 if str isn't a plain number
+ */
+long parseCount(const char *str) {
+    if (*str == '\0' || strspn(str, "0123456789") != strlen(str)) {
+        return -1;
+    }
+    errno = 0;
+    long count = strtol(str, nullptr, 10);
+    return errno == 0 ? count : -1;
+}
+
+/**
+ * Checks if a command can run as a native stage
+ * @param command the command
+ * @param count receives the line count for head and tail
+ * @return the native implementation, nullptr if the real program has to be executed
+ */
+NativeStage nativeStage(Command *command, long &count) {
+    std::vector<std::string *> &args = *(command->args);
+    if (strcmp(command->command, "wc") == 0) {
+        count = 0;
+        return args.size() == 2 && *args[1] == "-l" ? nativeWc : nullptr;
+    }
+    NativeStage stage;
+    if (strcmp(command->command, "head") == 0) {
+        stage = nativeHead;
+    } else if (strcmp(command->command, "tail") == 0) {
+        stage = nativeTail;
+    } else {
+        return nullptr;
+    }
+    if (args.size() == 1) {
+        count = 10;
+    } else if (args.size() == 2 && args[1]->compare(0, 2, "-n") == 0) {
+        count = parseCount(args[1]->c_str() + 2);
+    } else if (args.size() == 3 && *args[1] == "-n") {
+        count = parseCount(args[2]->c_str());
+    } else {
+        return nullptr;
+    }
+    return count >= 0 ? stage : nullptr;
+}
@@ -0,0 +1,104 @@
+/**
+ * Benchmark of the native head, tail and wc -l stages against coreutils
+ *
+ * Every pipeline runs once with the native stages and once with the coreutils programs, which are called by their full
+ * path so the shell doesn't replace them. The input is a generated file in a temporary directory.
+ *
+ * Build with -DCMAKE_BUILD_TYPE=Release, without optimizations the SIMD code is slower than coreutils.
+ *
+ * Usage: shellbench [size in MiB] [repetitions]
+ */
+
+#include "shell_internal.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Replaces head, tail and wc in a pipeline by the full path of the program
+ */
+std::string coreutils(const std::string &line) {
+    std::string result;
+    size_t start = 0;
+    while (start <= line.size()) {
+        size_t end = line.find(' ', start);
+        std::string word = line.substr(start, end == std::string::npos ? std::string::npos : end - start);
+        if (word == "head" || word == "tail" || word == "wc") {
+            word = resolveExecutable(word.c_str());
+        }
+        result += (result.empty() ? "" : " ") + word;
+        if (end == std::string::npos) {
+            break;
+        }
+        start = end + 1;
+    }
+    return result;
+}
+
+/**
+ * Runs a line a number of times
+ * @return the median wall clock time in milliseconds
+ */
+double measure(const std::string &line, int repetitions) {
+    int devnull = open("/dev/null", O_RDWR);
+    std::vector<double> times;
+    for (int i = 0; i < repetitions; i++) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        Shell::run(line, devnull, devnull);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        times.push_back((end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+    }
+    close(devnull);
+    std::sort(times.begin(), times.end());
+    return times[times.size() / 2];
+}
+
+int main(int argc, char **argv) {
+    long size = argc > 1 ? atol(argv[1]) : 64;
+    int repetitions = argc > 2 ? atoi(argv[2]) : 5;
+
+    char dir[] = "/tmp/shellbench.XXXXXX";
+    if (mkdtemp(dir) == nullptr || chdir(dir) != 0) {
+        perror("shellbench");
+        return 1;
+    }
+    std::string block;
+    for (int i = 0; block.size() < 1024 * 1024; i++) {
+        block += std::string(static_cast<size_t>(i % 80), 'x') + std::to_string(i) + "\n";
+    }
+    int fd = open("input", O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    for (long i = 0; i < size; i++) {
+        writeAll(fd, block.data(), block.size());
+    }
+    close(fd);
+
+    const char *lines[] = {
+            "wc -l < input",
+            "head -n 100000 < input",
+            "tail -n 100000 < input",
+            "cat < input | wc -l",
+            "cat < input | head -n 3 | tail -n 1",
+            "cat < input | tail -n 1",
+            "cat < input | head -n 100000 | wc -l",
+    };
+    std::cout << std::left << std::setw(40) << "pipeline" << std::right << std::setw(12) << "native"
+              << std::setw(12) << "coreutils" << std::setw(10) << "speedup" << std::endl;
+    for (const char *line : lines) {
+        double native = measure(line, repetitions);
+        double external = measure(coreutils(line), repetitions);
+        std::cout << std::left << std::setw(40) << line << std::right << std::fixed << std::setprecision(2)
+                  << std::setw(10) << native << "ms" << std::setw(10) << external << "ms"
+                  << std::setw(9) << external / native << "x" << std::endl;
+    }
+
+    unlink("input");
+    chdir("/");
+    rmdir(dir);
+    return 0;
+}
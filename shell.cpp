@@ -2,23 +2,31 @@
  * Implementation of a limited shell in C++
  *
  * This shell implementation uses a lexer and parser to parse command lines. A recursive datatype was chosen for the
- * commands. This makes the parser a recursive function, and the executor too. The recursive functions make for a
- * beautiful program flow because less state has to be saved, only a file descriptor and command have to be passed
- * through.
+ * commands. This makes the parser a recursive function. The executor flattens the chain into an ExecutionPlan, so all
+ * the work that can fail is done in the shell process before anything is forked.
  *
  * The parser design has been largely influenced by http://thinkingeek.com/gcc-tiny/. I understand that a parser such
  * as implemented in this shell is more complicated than needed for the easy syntax. However using this parser, it was
  * really easy to add the >> operator, and even more syntax elements could be easily added.
  *
- * When executing the input, executeCommand(Command) first checks if STDIN needs to be read from a file. It uses
- * open() to open the file if needed, otherwise STDIN_FILENO is used to pass to executeCommand(Command, input).
- * This function will fork(), and the child will dup2() the needed STDIN and STDOUT file pointers. Sometimes STDIN
- * is dup2()'ed to STDIN, but this causes no problems.
- * The child uses close() to close it's unneeded pipe end, the parent does too. The last pipe output is send back to
- * executeCommand(Command). It will check if the data needs to be redirected to a file or to STDOUT, and will copy
- * from the pipe to the required file pointer.
- * If the input has a & at the end, the function is done. Otherwise it will use waitpid() to wait for the children to
- * complete.
+ * When executing the input, executeCommand(Command) first builds an ExecutionPlan with planCommand(Command). This
+ * resolves every executable in PATH and builds all argv arrays before anything is forked, so a line with an unknown
+ * command fails in the shell process itself. Then it checks if STDIN needs to be read from a file. It uses open() to
+ * open the file if needed, otherwise STDIN_FILENO is used. wirePlan() creates all pipes and decides which file
+ * descriptors every stage gets as STDIN and STDOUT. executeCommand(ExecutionPlan) will fork() for every stage, and the
+ * child only has to dup2() its STDIN and STDOUT and execve(). Sometimes STDIN is dup2()'ed to STDIN, but this causes
+ * no problems.
+ * Every file descriptor the shell opens is close-on-exec, and the children close everything above STDERR with
+ * close_range() before they run. So no stage keeps another stage's pipe end open, and a producer gets SIGPIPE as soon
+ * as its consumer exits. The parent closes the pipes after forking. The last pipe output is send back to
+ * executeCommand(Command). It will check if the data needs to be redirected to a file or to STDOUT, and will copy from
+ * the pipe to the required file pointer.
+ * If the input has a & at the end, the function is done, its processes are reaped before a later line runs. Otherwise
+ * waitPlan() opens a pidfd for every stage and waits for all of them in one epoll loop, together with a signalfd for
+ * the signals it passes on to the stages. The status of the line is the status of the last stage that failed, like sh
+ * with pipefail. The timeout prefix builtin puts the stages in their own process group and kills that group when the
+ * loop's deadline passes. watch-run passes its inotify descriptor to that loop as well, so a change to a watched file
+ * kills the running pipeline the same way.
  *
  * shell() will continue executing input lines unless showPrompt is false, which means the shell is in testing mode
  * and it will quit.
@@ -26,100 +34,35 @@
  * Jelle Besseling (s4743636)
  */
 
+#include "shell_internal.h"
+
+#include <algorithm>
+#include <iomanip>
 #include <iostream>
+#include <sstream>
 #include <unistd.h>
 #include <fcntl.h>
 #include <vector>
 #include <map>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <signal.h>
+#include <time.h>
+#include <linux/perf_event.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 
-/**
- * UnkownCommandException is thrown whenever a command is executed that can't be found
- */
-class UnkownCommandException : public std::exception {
-
-} UnkownCommandException;
-
-/**
- * TokenId represents the token type found in the input string.
- * IDENT: Identifier, a command or file for example
- * PIPE: Literal pipe character
- * REDIR_IN: Input redirection character (<)
- * REDIR_OUT: Output redirection character (>)
- * APPEND_OUT: Output redirection with append (>>)
- * BG: Run as background character (&)
- * END: End of the string
- */
-enum TokenId {
-    IDENT,
-    PIPE,
-    REDIR_IN,
-    REDIR_OUT,
-    APPEND_OUT,
-    BG,
-    END,
-};
-
-/**
- * Implementation of the Token type, supports a string value for identifiers.
- */
-struct Token {
-private:
-    TokenId token_id;
-    std::string *str;
-
-    explicit Token(TokenId token_id_)
-            : token_id(token_id_), str(nullptr) {}
-
-    explicit Token(TokenId token_id_, const std::string &str_)
-            : token_id(token_id_), str(new std::string(str_)) {}
-
-    Token();
-
-public:
-    /**
-     * Convenience method for creating a non-identifier
-     * @param id The token to create
-     * @return A newly created Token struct
-     */
-    static Token *make(TokenId id) {
-        return new Token(id);
-    }
-
-    /**
-     * Convenience method for creating an identifier
-     * @param str The string to attach to the identifier
-     * @return A newly created Token struct
-     */
-    static Token *makeIdent(const std::string &str) {
-        return new Token(TokenId::IDENT, str);
-    }
-
-    bool operator==(const Token &rhs) const {
-        if (str == nullptr) {
-            return token_id == rhs.token_id && rhs.str == nullptr;
-        }
-        if (rhs.str == nullptr) {
-            return token_id == rhs.token_id;
-        }
-        return token_id == rhs.token_id &&
-               *str == *rhs.str;
-    }
-
-    bool operator!=(const Token &rhs) const {
-        return !(rhs == *this);
-    }
-
-    TokenId get_id() {
-        return this->token_id;
-    }
-
-    std::string *get_str() const {
-        return this->str;
-    }
-};
+extern char **environ;
 
 /**
  * Consumes a bit of the input string and return the token that it represents
@@ -189,72 +132,6 @@ bool strEqOrNull(const char *x, const char *y) {
     return x != nullptr && y != nullptr && strcmp(x, y) == 0;
 }
 
-/**
- * Implementation of the Command struct
- *
- * Uses a recursive structure, if the commandline has multiple commands chained with pipes, the Command struct will
- * have a child Command in pipe_to. This means the executeCommand function can also be executed recursively.
- *
- * The command itself is stored in a char* so it can be easily passed to execvp.
- * The command arguments are stored in a vector so C++ methods can be used for simplicity.
- * bg flag is set when the command is proceeded by an ampersand. This is ignored if the command isn't the last command.
- * append flag is set when redir_out is an appending file redirection
- * redir_in and redir_out are set to filenames when input and output redirection are used, otherwise they are NULL
- */
-struct Command {
-    const char *command;
-    std::vector<std::string *> *args;
-    bool bg;
-    bool append;
-    const char *redir_in;
-    const char *redir_out;
-
-    Command *pipe_to;
-
-    /**
-     * Constructor for the empty command
-     */
-    explicit Command() : command(nullptr), args(nullptr), bg(false), append(false), redir_in(nullptr),
-                         redir_out(nullptr), pipe_to(nullptr) {}
-
-    bool operator==(const Command &rhs) const {
-        if (!strEqOrNull(command, rhs.command)) {
-            return false;
-        }
-        if (!strEqOrNull(redir_in, rhs.redir_in)) {
-            return false;
-        }
-        if (!strEqOrNull(redir_out, rhs.redir_out)) {
-            return false;
-        }
-        if (bg != rhs.bg) {
-            return false;
-        }
-        if (append != rhs.append) {
-            return false;
-        }
-        if (args->size() != rhs.args->size()) {
-            return false;
-        }
-        for (size_t i = 0; i < args->size(); i++) {
-            if (args[i] == rhs.args[i]) {
-                return false;
-            }
-        }
-        if ((pipe_to == nullptr && rhs.pipe_to != nullptr) || (pipe_to != nullptr && rhs.pipe_to == nullptr)) {
-            return false;
-        }
-        if (pipe_to == nullptr && rhs.pipe_to == nullptr) {
-            return true;
-        }
-        return *pipe_to == *rhs.pipe_to;
-    }
-
-    bool operator!=(const Command &rhs) const {
-        return !(rhs == *this);
-    }
-};
-
 /**
  * Repeatedly calls buildToken to convert the input string to a vector of tokens
  * @param commandLine input string
@@ -268,13 +145,14 @@ std::vector<Token *> tokenList(std::string &commandLine) {
         token_list.push_back(cur_token);
         cur_token = buildToken(commandLine);
     }
+    delete cur_token;
     return token_list;
 }
 
 /**
  * Converts a list of tokens to the recursive Command struct
- * @param tokens vector of tokens
- * @return the root command with optional subcommands
+ * @param tokens vector of tokens, they still belong to the caller and must outlive the command
+ * @return the root command with optional subcommands, nullptr on syntax errors
  */
 Command *buildCommands(std::vector<Token *> tokens) {
     if (tokens.empty()) {
@@ -284,6 +162,7 @@ Command *buildCommands(std::vector<Token *> tokens) {
     Token *cur_token = tokens.front();
     tokens.erase(tokens.begin());
     if (cur_token->get_id() != TokenId::IDENT) {
+        delete command;
         return nullptr;
     }
     for (;;) {
@@ -293,10 +172,12 @@ Command *buildCommands(std::vector<Token *> tokens) {
                 break;
             case TokenId::REDIR_IN: {
                 if (tokens.empty()) {
+                    delete command;
                     return nullptr;
                 }
                 Token *peek = tokens.front();
                 if (peek->get_id() != TokenId::IDENT) {
+                    delete command;
                     return nullptr; // File is an ident
                 }
                 command->redir_in = peek->get_str()->c_str();
@@ -309,10 +190,12 @@ Command *buildCommands(std::vector<Token *> tokens) {
             }
             case TokenId::REDIR_OUT: {
                 if (tokens.empty()) {
+                    delete command;
                     return nullptr;
                 }
                 Token *peek = tokens.front();
                 if (peek->get_id() != TokenId::IDENT) {
+                    delete command;
                     return nullptr; // File is an ident
                 }
                 command->redir_out = peek->get_str()->c_str();
@@ -322,29 +205,27 @@ Command *buildCommands(std::vector<Token *> tokens) {
             case TokenId::PIPE:
                 command->pipe_to = buildCommands(tokens);
                 if (command->pipe_to == nullptr) {
+                    delete command;
                     return nullptr;
                 }
                 return command;
             case TokenId::END:
                 return command;
             case TokenId::IDENT: {
-                Token *peek = tokens.front();
                 command->command = cur_token->get_str()->c_str();
                 auto args = new std::vector<std::string *>;
                 args->push_back(cur_token->get_str());
-                while (peek->get_id() == TokenId::IDENT) {
-                    if (tokens.empty()) {
-                        break;
-                    }
+                while (!tokens.empty() && tokens.front()->get_id() == TokenId::IDENT) {
+                    args->push_back(tokens.front()->get_str());
                     tokens.erase(tokens.begin());
-                    args->push_back(peek->get_str());
-                    peek = tokens.front();
                 }
+                delete command->args; // Words after a redirection start a new argument list, like before
                 command->args = args;
                 break;
             }
         }
         if (tokens.empty() && command->command == nullptr) {
+            delete command;
             return nullptr;
         }
         if (tokens.empty()) {
@@ -358,27 +239,51 @@ Command *buildCommands(std::vector<Token *> tokens) {
 /**
  * Tries to execute command as a builtin
  *
- * Has no test cases because of awkward side-effects, but was thoroughly tested by hand
+ * ShellRun.Status tests cd and exit through Shell::run, ShellRun.Cached and ShellRun.Stats the builtins with output.
  *
  * @param command the command to try to execute
+ * @param stdout_fd where builtins with output write to when there is no output redirection
+ * @param result receives the status of the builtin, exit is set for the exit builtin
  * @return true if the command was executed as a builtin
  */
-bool executeBuiltin(Command *command) {
+bool executeBuiltin(Command *command, int stdout_fd, Shell::Result &result) {
     if (command->pipe_to != nullptr) {
         return false;
     }
     if (strcmp(command->command, "exit") == 0) {
-        exit(0);
+        addMetric(metrics().builtins, 1);
+        result.exit = true;
+        return true;
+    }
+    if (strcmp(command->command, "cache-stats") == 0 || strcmp(command->command, "stats") == 0) {
+        addMetric(metrics().builtins, 1);
+        std::ostringstream stats;
+        if (strcmp(command->command, "stats") == 0) {
+            printMetrics(stats);
+        } else {
+            printCacheStats(stats);
+        }
+        int out = command->redir_out != nullptr ? openRedirOut(command) : stdout_fd;
+        if (out == -1 || !writeAll(out, stats.str().data(), stats.str().size())) {
+            result.status = 1;
+        }
+        if (command->redir_out != nullptr && out != -1) {
+            close(out);
+        }
+        return true;
     }
     std::vector<std::string *> &args = *(command->args);
     if (args.size() == 2 && strcmp(command->command, "cd") == 0) {
+        addMetric(metrics().builtins, 1);
         if (*args[1] == std::string("~")) { // Unfortunately the only case when ~ is expanded
             if (chdir(getenv("HOME")) < 0) {
                 perror("cd");
+                result.status = 1;
             }
         } else {
             if (chdir(args[1]->c_str()) < 0) {
                 perror("cd");
+                result.status = 1;
             }
         }
         return true;
@@ -387,50 +292,355 @@ bool executeBuiltin(Command *command) {
 }
 
 /**
- * Calls itself recursively until the last command. Needs to be called by executeCommand(Command)
- *
- * @param command command to execute
- * @param input reading end from previous pipe
- * @return reading end from current pipe
+ * Parses a duration like coreutils timeout does: a number with an optional suffix s, m, h or d. Like coreutils it
+ * accepts inf and durations too long to represent, those become LONG_MAX.
+ * @param str the duration
+ * @return the duration in milliseconds, -1 if str isn't a valid duration
  */
-int executeCommand(Command *command, int input) {
-    int pipefd[2];
-    if (pipe(pipefd) == -1) {
-        perror("pipe");
-        exit(EXIT_FAILURE);
+long parseDuration(const char *str) {
+    char *end;
+    errno = 0;
+    double value = strtod(str, &end);
+    if (end == str || (errno != 0 && errno != ERANGE) || isnan(value) || value < 0) {
+        return -1;
+    }
+    switch (*end) {
+        case '\0':
+        case 's':
+            break;
+        case 'm':
+            value *= 60;
+            break;
+        case 'h':
+            value *= 60 * 60;
+            break;
+        case 'd':
+            value *= 24 * 60 * 60;
+            break;
+        default:
+            return -1;
+    }
+    if (*end != '\0' && end[1] != '\0') {
+        return -1;
+    }
+    // Converting a double that doesn't fit is undefined, LONG_MAX itself isn't exact as a double
+    if (value * 1000 >= static_cast<double>(LONG_MAX)) {
+        return LONG_MAX;
+    }
+    return static_cast<long>(value * 1000);
+}
+
+/**
+ * Removes prefix builtins from the first command of a pipeline and sets the options they stand for. Supported are
+ * timeout DURATION, where a duration of 0 means no timeout, perfstat and cached [dependencies...] --. They can be
+ * combined.
+ * @param command first command of the pipeline, changed in place
+ * @param options receives the options
+ * @return false if a prefix was used wrongly, an error has been printed then
+ */
+bool applyPrefixes(Command *command, PipelineOptions &options) {
+    std::vector<std::string *> &args = *(command->args);
+    for (;;) {
+        if (strcmp(command->command, "perfstat") == 0) {
+            if (args.size() < 2) {
+                std::cerr << "perfstat: usage: perfstat command" << std::endl;
+                return false;
+            }
+            if (command->bg) {
+                std::cerr << "perfstat: can't be used with &" << std::endl;
+                return false;
+            }
+            options.perfstat = true;
+            args.erase(args.begin());
+            command->command = args[0]->c_str();
+            continue;
+        }
+        if (strcmp(command->command, "cached") == 0) {
+            size_t separator = 1;
+            for (; separator < args.size() && *args[separator] != "--"; separator++) {
+                options.dependencies.push_back(*args[separator]);
+            }
+            if (separator + 1 >= args.size()) {
+                std::cerr << "cached: usage: cached [dependencies...] -- command" << std::endl;
+                return false;
+            }
+            if (command->bg) {
+                std::cerr << "cached: can't be used with &" << std::endl;
+                return false;
+            }
+            options.cached = true;
+            args.erase(args.begin(), args.begin() + separator + 1);
+            command->command = args[0]->c_str();
+            continue;
+        }
+        if (strcmp(command->command, "timeout") != 0) {
+            return true;
+        }
+        if (args.size() < 3) {
+            std::cerr << "timeout: usage: timeout DURATION command" << std::endl;
+            return false;
+        }
+        long timeout = parseDuration(args[1]->c_str());
+        if (timeout < 0) {
+            std::cerr << "timeout: invalid duration " << *args[1] << std::endl;
+            return false;
+        }
+        if (command->bg) {
+            std::cerr << "timeout: can't be used with &" << std::endl;
+            return false;
+        }
+        options.timeout = timeout == 0 ? -1 : timeout;
+        args.erase(args.begin(), args.begin() + 2);
+        command->command = args[0]->c_str();
+    }
+}
+
+/**
+ * Shell that runs executable files execve() doesn't recognize, like execvp does
+ */
+const char *const SCRIPT_SHELL = "/bin/sh";
+
+/**
+ * Looks up an executable the same way execvp does: names containing a slash are used as is, other names are searched
+ * for in PATH
+ * @param name command name as typed
+ * @return path to the executable, or an empty string if it can't be found
+ */
+std::string resolveExecutable(const char *name) {
+    if (strchr(name, '/') != nullptr) {
+        return access(name, X_OK) == 0 ? std::string(name) : std::string();
     }
+    const char *path = getenv("PATH");
+    if (path == nullptr) {
+        path = "/bin:/usr/bin";
+    }
+    std::string dirs(path);
+    size_t start = 0;
+    for (;;) {
+        size_t end = dirs.find(':', start);
+        std::string dir = dirs.substr(start, end == std::string::npos ? std::string::npos : end - start);
+        std::string candidate = (dir.empty() ? std::string(".") : dir) + "/" + name;
+        struct stat st;
+        if (stat(candidate.c_str(), &st) == 0 && S_ISREG(st.st_mode) && access(candidate.c_str(), X_OK) == 0) {
+            return candidate;
+        }
+        if (end == std::string::npos) {
+            return std::string();
+        }
+        start = end + 1;
+    }
+}
 
-    pid_t child_pid = fork();
-    if (child_pid == 0) {
-        std::vector<std::string *> &args = *(command->args);
-        auto **c_args = new char *[args.size() + 2];
-        for (size_t i = 1; i < args.size(); i++)
-            c_args[i] = strdup(args[i]->c_str());
-        c_args[0] = strdup(command->command);
-        c_args[args.size()] = nullptr;
+/**
+ * Resolves every command in the chain and builds all argv arrays. Nothing is forked or opened here, so an unknown
+ * command makes the whole line fail before any process is created. Commands that can run as a native stage aren't
+ * looked up.
+ * Every stage also gets the argv to run its path with /bin/sh, for executable scripts without a #! line that execve()
+ * refuses with ENOEXEC. execvp does the same.
+ * @param command the root command
+ * @return the plan, without file descriptors wired up yet
+ * @throws UnkownCommandException if one of the commands can't be found
+ */
+ExecutionPlan *planCommand(Command *command) {
+    std::vector<std::string> paths;
+    size_t pointers = 0;
+    size_t chars = 0;
+    for (Command *cur = command; cur != nullptr; cur = cur->pipe_to) {
+        long count;
+        std::string path;
+        if (nativeStage(cur, count) == nullptr) {
+            path = resolveExecutable(cur->command);
+            if (path.empty()) {
+                addMetric(metrics().exec_failures, 1);
+                throw UnkownCommandException(cur->command);
+            }
+        }
+        chars += path.size() + 1;
+        for (std::string *arg : *(cur->args)) {
+            chars += arg->size() + 1;
+        }
+        // argv, and the argv for /bin/sh: the shell, the path and the arguments after the command
+        pointers += cur->args->size() + 1 + cur->args->size() + 2;
+        paths.push_back(path);
+    }
+    chars += strlen(SCRIPT_SHELL) + 1;
 
-        dup2(input, STDIN_FILENO);
-        dup2(pipefd[1], STDOUT_FILENO);
+    auto *plan = new ExecutionPlan;
+    plan->block = new char[pointers * sizeof(char *) + chars];
+    auto **argv = reinterpret_cast<char **>(plan->block);
+    char *strings = plan->block + pointers * sizeof(char *);
+    char *script_shell = strings;
+    memcpy(strings, SCRIPT_SHELL, strlen(SCRIPT_SHELL) + 1);
+    strings += strlen(SCRIPT_SHELL) + 1;
+    size_t i = 0;
+    for (Command *cur = command; cur != nullptr; cur = cur->pipe_to, i++) {
+        Stage stage;
+        stage.native = nativeStage(cur, stage.count);
+        char *path = strings;
+        memcpy(path, paths[i].c_str(), paths[i].size() + 1);
+        stage.path = path;
+        strings += paths[i].size() + 1;
 
-        close(pipefd[0]);
+        stage.argv = argv;
+        for (std::string *arg : *(cur->args)) {
+            memcpy(strings, arg->c_str(), arg->size() + 1);
+            *(argv++) = strings;
+            strings += arg->size() + 1;
+        }
+        *(argv++) = nullptr;
 
-        execvp(command->command, c_args);
+        stage.script_argv = argv;
+        *(argv++) = script_shell;
+        *(argv++) = path;
+        for (size_t arg = 1; stage.argv[arg] != nullptr; arg++) {
+            *(argv++) = stage.argv[arg];
+        }
+        *(argv++) = nullptr;
+        plan->stages.push_back(stage);
+    }
+    return plan;
+}
 
-        for (size_t i = 0; i < args.size(); ++i)
-            free(c_args[i]);
-        delete[] c_args;
+/**
+ * Creates the pipes between the stages and assigns every stage its STDIN and STDOUT. The pipes are created
+ * close-on-exec, the child clears that flag on the descriptors it actually uses: dup2() does for the copies, but a
+ * descriptor that already is STDIN or STDOUT needs fcntl().
+ * @param plan plan to wire up
+ * @param input file descriptor the first stage reads from
+ * @return false if the pipes couldn't be created, closePlan still has to be called to close the ones that were
+ */
+bool wirePlan(ExecutionPlan *plan, int input) {
+    int first = input;
+    for (Stage &stage : plan->stages) {
+        int pipefd[2];
+        if (pipe2(pipefd, O_CLOEXEC) == -1) {
+            perror("pipe");
+            if (input != first) {
+                close(input);
+            }
+            return false;
+        }
+        stage.in = input;
+        stage.out = pipefd[1];
+        input = pipefd[0];
+    }
+    plan->output = input;
+    return true;
+}
 
-        throw UnkownCommandException;
-    } else {
-        close(pipefd[1]);
-        if (command->pipe_to == nullptr) {
-            return pipefd[0];
-        } else {
-            return executeCommand(command->pipe_to, pipefd[0]);
+/**
+ * Closes the file descriptors wirePlan created, except for the reading end of the last pipe
+ * @param plan a wired plan
+ */
+void closePlan(ExecutionPlan *plan) {
+    for (size_t i = 0; i < plan->stages.size(); i++) {
+        if (plan->stages[i].out != -1) {
+            close(plan->stages[i].out);
+        }
+        if (i > 0 && plan->stages[i].in != -1) {
+            close(plan->stages[i].in);
         }
     }
 }
 
+/**
+ * @return the signals the shell forwards to the stages while it waits for them
+ */
+sigset_t forwardedSignals() {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGQUIT);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGHUP);
+    return set;
+}
+
+/**
+ * Forks every stage of a wired plan. The children only set their process group and signal mask, dup2() their STDIN
+ * and STDOUT, close all other file descriptors and call execve(). For perfstat the counters are attached to every
+ * child before it may execve(). Native stages run in the child itself.
+ *
+ * The forwarded signals stay blocked in the shell after this returns, waitPlan picks them up. Whoever doesn't call
+ * waitPlan has to restore plan->sigmask.
+ * @param plan a wired plan
+ * @return reading end of the last pipe
+ */
+int executeCommand(ExecutionPlan *plan) {
+    if (plan->perfstat && pipe2(plan->go, O_CLOEXEC) == -1) {
+        perror("pipe");
+        plan->perfstat = false;
+    }
+    sigset_t forwarded = forwardedSignals();
+    sigprocmask(SIG_BLOCK, &forwarded, &plan->sigmask);
+    // Created before the first fork, so the children count into the same mapping
+    Metrics &m = metrics();
+    for (Stage &stage : plan->stages) {
+        stage.started = monotonicMicros();
+        stage.pid = fork();
+        if (stage.pid == 0) {
+            if (plan->own_group) {
+                setpgid(0, plan->pgid);
+            }
+            sigprocmask(SIG_SETMASK, plan->stage_mask != nullptr ? plan->stage_mask : &plan->sigmask, nullptr);
+            if (plan->perfstat) {
+                char go;
+                read(plan->go[0], &go, 1);
+            }
+            // dup2() onto the same descriptor does nothing, it doesn't clear close-on-exec either. An embedding
+            // program with STDIN closed gets the input file or a pipe on descriptor 0, and likewise for STDOUT.
+            if (stage.in == STDIN_FILENO) {
+                fcntl(STDIN_FILENO, F_SETFD, 0);
+            } else {
+                dup2(stage.in, STDIN_FILENO);
+            }
+            if (stage.out == STDOUT_FILENO) {
+                fcntl(STDOUT_FILENO, F_SETFD, 0);
+            } else {
+                dup2(stage.out, STDOUT_FILENO);
+            }
+            // Native stages have no execve() to close the close-on-exec pipes, and programs embedding the shell may
+            // have file descriptors open without O_CLOEXEC. Any pipe end left open keeps producers from getting
+            // SIGPIPE.
+            syscall(SYS_close_range, 3, ~0U, 0);
+            if (stage.native != nullptr) {
+                _exit(stage.native(stage.count));
+            }
+            execve(stage.path, stage.argv, environ);
+            if (errno == ENOEXEC) {
+                execve(stage.script_argv[0], stage.script_argv, environ);
+            }
+            perror(stage.argv[0]);
+            addMetric(m.exec_failures, 1);
+            _exit(127);
+        }
+        if (stage.pid == -1) {
+            perror("fork");
+            break;
+        }
+        addMetric(m.forks, 1);
+        if (plan->own_group) {
+            // Also done in the parent, so the group exists before the next stage tries to join it
+            setpgid(stage.pid, plan->pgid);
+            if (plan->pgid == 0) {
+                plan->pgid = stage.pid;
+            }
+        }
+        if (plan->perfstat) {
+            openCounters(stage);
+        }
+    }
+    if (plan->perfstat) {
+        // One byte for every child, they can execve() now that their counters are attached
+        std::string go(plan->stages.size(), 'g');
+        write(plan->go[1], go.data(), go.size());
+        close(plan->go[0]);
+        close(plan->go[1]);
+    }
+    closePlan(plan);
+    return plan->output;
+}
+
 /**
  * @param pCommand some command in a chain of commands
  * @return the last command of a recursive chain of commands
@@ -443,51 +653,566 @@ Command *lastCommand(Command *pCommand) {
 }
 
 /**
- * This function recursively calls executeCommand(Command, int), it also correctly redirects the first and last commands
- * to stdin and stdout or file redirects.
+ * Converts a status from wait() to an exit status like sh reports it
+ * @param wstatus status from wait()
+ * @return exit code, or 128 + signal number if the process was killed by a signal
+ */
+int exitStatus(int wstatus) {
+    if (WIFSIGNALED(wstatus)) {
+        return 128 + WTERMSIG(wstatus);
+    }
+    return WEXITSTATUS(wstatus);
+}
+
+/**
+ * Adds the resource usage of a child to a running total
+ * @param total total to add to
+ * @param usage usage of one child
+ */
+void addRusage(struct rusage &total, const struct rusage &usage) {
+    timeradd(&total.ru_utime, &usage.ru_utime, &total.ru_utime);
+    timeradd(&total.ru_stime, &usage.ru_stime, &total.ru_stime);
+    if (usage.ru_maxrss > total.ru_maxrss) {
+        total.ru_maxrss = usage.ru_maxrss;
+    }
+    total.ru_minflt += usage.ru_minflt;
+    total.ru_majflt += usage.ru_majflt;
+    total.ru_inblock += usage.ru_inblock;
+    total.ru_oublock += usage.ru_oublock;
+    total.ru_nvcsw += usage.ru_nvcsw;
+    total.ru_nivcsw += usage.ru_nivcsw;
+}
+
+/**
+ * Sends a signal to every stage of a plan, to the whole process group if the stages have their own
+ * @param plan plan with forked stages
+ * @param sig signal to send
+ */
+void signalPlan(ExecutionPlan *plan, int sig) {
+    if (plan->own_group && plan->pgid > 0) {
+        kill(-plan->pgid, sig);
+        return;
+    }
+    for (Stage &stage : plan->stages) {
+        if (stage.pidfd != -1) {
+            syscall(SYS_pidfd_send_signal, stage.pidfd, sig, nullptr, 0);
+        }
+    }
+}
+
+/**
+ * Reaps a stage that has exited and records its status
+ * @param stage the stage
+ * @param usage resource usage of the stage is added to this
+ * @param options 0 to block until the stage exits, or WNOHANG
+ * @return true if the stage was reaped
+ */
+bool reapStage(Stage &stage, struct rusage &usage, int options) {
+    int wstatus;
+    struct rusage stage_usage;
+    pid_t pid;
+    do {
+        pid = wait4(stage.pid, &wstatus, options, &stage_usage);
+    } while (pid == -1 && errno == EINTR);
+    if (pid <= 0) {
+        return false;
+    }
+    stage.status = exitStatus(wstatus);
+    stage.reaped = true;
+    stage.usage = stage_usage;
+    recordLatency(metrics().stage_latency, monotonicMicros() - stage.started);
+    addRusage(usage, stage_usage);
+    if (stage.pidfd != -1) {
+        close(stage.pidfd);
+        stage.pidfd = -1;
+    }
+    return true;
+}
+
+/**
+ * @return milliseconds on the monotonic clock
+ */
+long monotonicMillis() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000L + now.tv_nsec / 1000000L;
+}
+
+/**
+ * Waits for every stage of a plan in one epoll loop, without polling. Every stage gets a pidfd that becomes readable
+ * when it exits, the forwarded signals arrive through a signalfd.
+ *
+ * Signals the shell receives in the meantime are passed on to the stages. SIGINT and SIGQUIT from the terminal already
+ * reached stages that share the group of the shell, those aren't sent twice. Signals that didn't come from the terminal
+ * are raised again for the shell itself once all stages are done.
+ *
+ * When the timeout expires or the cancel file descriptor becomes readable, the stages get SIGTERM, and SIGKILL if they
+ * are still running a second later. After a timeout their status is set to 124.
+ *
+ * The metrics file is written from this loop as well when it's due, so it doesn't go stale during long pipelines.
+ *
+ * Restores plan->sigmask when done.
+ * @param plan plan with forked stages
+ * @param timeout milliseconds before the stages are killed, -1 for no timeout
+ * @param cancel file descriptor that becomes readable when the stages have to be killed, -1 for none
+ * @param usage resource usage of all stages is added to this
+ * @return the last signal the shell received while waiting, 0 if none
+ */
+int waitPlan(ExecutionPlan *plan, long timeout, int cancel, struct rusage &usage) {
+    size_t running = 0;
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    sigset_t forwarded = forwardedSignals();
+    int sigfd = signalfd(-1, &forwarded, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (epfd == -1 || sigfd == -1) {
+        perror("epoll");
+    } else {
+        struct epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.u64 = plan->stages.size();
+        epoll_ctl(epfd, EPOLL_CTL_ADD, sigfd, &event);
+        if (cancel != -1) {
+            event.data.u64 = plan->stages.size() + 1;
+            epoll_ctl(epfd, EPOLL_CTL_ADD, cancel, &event);
+        }
+        if (metricsTimer() != -1) {
+            event.data.u64 = plan->stages.size() + 2;
+            epoll_ctl(epfd, EPOLL_CTL_ADD, metricsTimer(), &event);
+        }
+        for (size_t i = 0; i < plan->stages.size(); i++) {
+            Stage &stage = plan->stages[i];
+            if (stage.pid <= 0) {
+                continue;
+            }
+            stage.pidfd = static_cast<int>(syscall(SYS_pidfd_open, stage.pid, 0));
+            if (stage.pidfd == -1) {
+                continue; // Reaped with a blocking wait below
+            }
+            event.data.u64 = i;
+            epoll_ctl(epfd, EPOLL_CTL_ADD, stage.pidfd, &event);
+            running++;
+        }
+    }
+
+    long deadline = -1;
+    if (timeout >= 0) {
+        long now = monotonicMillis();
+        deadline = timeout < LONG_MAX - now ? now + timeout : LONG_MAX;
+    }
+    bool timed_out = false;
+    bool terminating = false;
+    int received = 0;
+    int reraise = 0;
+    auto terminate = [&]() {
+        terminating = true;
+        signalPlan(plan, SIGTERM);
+        deadline = monotonicMillis() + 1000;
+    };
+    while (running > 0) {
+        int wait = -1;
+        if (deadline >= 0) {
+            // epoll_wait takes an int, longer timeouts wait in steps of about 24.8 days
+            wait = static_cast<int>(std::min(std::max(0L, deadline - monotonicMillis()), static_cast<long>(INT_MAX)));
+        }
+        struct epoll_event events[8];
+        int count = epoll_wait(epfd, events, 8, wait);
+        if (count == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            break;
+        }
+        if (count == 0) {
+            if (monotonicMillis() < deadline) {
+                continue;
+            }
+            if (!terminating) {
+                timed_out = true;
+                terminate();
+            } else {
+                signalPlan(plan, SIGKILL);
+                deadline = -1;
+            }
+            continue;
+        }
+        for (int i = 0; i < count; i++) {
+            if (events[i].data.u64 == plan->stages.size()) {
+                struct signalfd_siginfo info;
+                while (read(sigfd, &info, sizeof(info)) == sizeof(info)) {
+                    bool from_terminal = info.ssi_code == SI_KERNEL;
+                    if (!from_terminal || plan->own_group) {
+                        signalPlan(plan, static_cast<int>(info.ssi_signo));
+                    }
+                    if (!from_terminal) {
+                        reraise = static_cast<int>(info.ssi_signo);
+                    }
+                    received = static_cast<int>(info.ssi_signo);
+                }
+                continue;
+            }
+            if (events[i].data.u64 == plan->stages.size() + 2) {
+                exportMetricsIfDue();
+                continue;
+            }
+            if (events[i].data.u64 == plan->stages.size() + 1) {
+                epoll_ctl(epfd, EPOLL_CTL_DEL, cancel, nullptr);
+                if (!terminating) {
+                    terminate();
+                }
+                continue;
+            }
+            Stage &stage = plan->stages[events[i].data.u64];
+            epoll_ctl(epfd, EPOLL_CTL_DEL, stage.pidfd, nullptr);
+            reapStage(stage, usage, WNOHANG);
+            running--;
+        }
+    }
+    for (Stage &stage : plan->stages) {
+        if (stage.pid > 0 && !stage.reaped) {
+            reapStage(stage, usage, 0);
+        }
+    }
+    if (timed_out) {
+        for (Stage &stage : plan->stages) {
+            stage.status = 124;
+        }
+    }
+    if (sigfd != -1) {
+        close(sigfd);
+    }
+    if (epfd != -1) {
+        close(epfd);
+    }
+    sigprocmask(SIG_SETMASK, &plan->sigmask, nullptr);
+    if (reraise != 0) {
+        raise(reraise);
+    }
+    return received;
+}
+
+/**
+ * @param plan a plan that has been waited for
+ * @return status of the last stage that failed, 1 if a stage was never forked, 0 if they all succeeded
+ */
+int pipelineStatus(ExecutionPlan *plan) {
+    int status = 0;
+    for (Stage &stage : plan->stages) {
+        if (stage.pid == -1) {
+            status = 1; // Never forked
+        } else if (stage.status != 0) {
+            status = stage.status;
+        }
+    }
+    return status;
+}
+
+/**
+ * Events perfstat counts, in the order of Stage::counters
+ */
+struct PerfCounter {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+} perfCounters[PERF_COUNTERS] = {
+        {"cycles",           PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {"instructions",     PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {"cache-misses",     PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+        {"context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+        {"page-faults",      PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+};
+
+/**
+ * Attaches the perfstat counters to a forked stage that hasn't called execve() yet. The counters are enabled by the
+ * execve() and inherited by processes the stage forks. When perf_event_paranoid doesn't allow counting kernel events
+ * only user space is counted, counters that can't be opened at all stay -1.
+ * @param stage the stage
+ */
+void openCounters(Stage &stage) {
+    for (size_t i = 0; i < PERF_COUNTERS; i++) {
+        struct perf_event_attr attr = {};
+        attr.size = sizeof(attr);
+        attr.type = perfCounters[i].type;
+        attr.config = perfCounters[i].config;
+        attr.disabled = stage.native == nullptr; // Native stages never execve(), they count from here
+        attr.enable_on_exec = stage.native == nullptr;
+        attr.inherit = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        int fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, stage.pid, -1, -1, PERF_FLAG_FD_CLOEXEC));
+        if (fd == -1 && (errno == EACCES || errno == EPERM)) {
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, stage.pid, -1, -1, PERF_FLAG_FD_CLOEXEC));
+        }
+        stage.counters[i] = fd;
+    }
+}
+
+/**
+ * Reads a counter, scaled up if the kernel had to multiplex it
+ * @param fd counter file descriptor
+ * @param value receives the count
+ * @return false if the counter is unavailable or never ran
+ */
+bool readCounter(int fd, uint64_t &value) {
+    uint64_t data[3]; // value, time enabled, time running
+    if (fd == -1 || read(fd, data, sizeof(data)) != sizeof(data) || data[2] == 0) {
+        return false;
+    }
+    value = data[2] < data[1] ? static_cast<uint64_t>(static_cast<double>(data[0]) * data[1] / data[2]) : data[0];
+    return true;
+}
+
+/**
+ * Prints a table with the counters of every stage of a perfstat pipeline plus totals. Context switches and page faults
+ * fall back to the rusage from wait4() when perf_event_open isn't allowed, those are marked with a *.
+ * @param plan a plan that has been waited for
+ * @param out where to print the table
+ */
+void printPerfStat(ExecutionPlan *plan, std::ostream &out) {
+    const int width = 18;
+    uint64_t totals[PERF_COUNTERS] = {};
+    bool available[PERF_COUNTERS] = {};
+    bool fallback = false;
+    struct rusage total_usage = {};
+
+    out << std::left << std::setw(width) << "stage" << std::right;
+    for (const PerfCounter &counter : perfCounters) {
+        out << std::setw(width) << counter.name;
+    }
+    out << std::setw(10) << "user" << std::setw(10) << "sys" << std::endl;
+
+    for (Stage &stage : plan->stages) {
+        out << std::left << std::setw(width) << stage.argv[0] << std::right;
+        for (size_t i = 0; i < PERF_COUNTERS; i++) {
+            uint64_t value;
+            bool counted = readCounter(stage.counters[i], value);
+            std::string mark;
+            if (!counted && perfCounters[i].type == PERF_TYPE_SOFTWARE) {
+                value = perfCounters[i].config == PERF_COUNT_SW_CONTEXT_SWITCHES
+                        ? stage.usage.ru_nvcsw + stage.usage.ru_nivcsw
+                        : stage.usage.ru_minflt + stage.usage.ru_majflt;
+                counted = true;
+                fallback = true;
+                mark = "*";
+            }
+            if (counted) {
+                totals[i] += value;
+                available[i] = true;
+                out << std::setw(width) << std::to_string(value) + mark;
+            } else {
+                out << std::setw(width) << "-";
+            }
+        }
+        addRusage(total_usage, stage.usage);
+        out << std::fixed << std::setprecision(3)
+            << std::setw(9) << stage.usage.ru_utime.tv_sec + stage.usage.ru_utime.tv_usec / 1e6 << "s"
+            << std::setw(9) << stage.usage.ru_stime.tv_sec + stage.usage.ru_stime.tv_usec / 1e6 << "s" << std::endl;
+    }
+
+    out << std::left << std::setw(width) << "total" << std::right;
+    for (size_t i = 0; i < PERF_COUNTERS; i++) {
+        out << std::setw(width) << (available[i] ? std::to_string(totals[i]) : std::string("-"));
+    }
+    out << std::setw(9) << total_usage.ru_utime.tv_sec + total_usage.ru_utime.tv_usec / 1e6 << "s"
+        << std::setw(9) << total_usage.ru_stime.tv_sec + total_usage.ru_stime.tv_usec / 1e6 << "s" << std::endl;
+    if (fallback) {
+        out << "* from rusage, perf_event_open is not available" << std::endl;
+    }
+}
+
+/**
+ * Closes the perf counters of every stage
+ * @param plan a perfstat plan
+ */
+void closeCounters(ExecutionPlan *plan) {
+    for (Stage &stage : plan->stages) {
+        for (int &counter : stage.counters) {
+            if (counter != -1) {
+                close(counter);
+                counter = -1;
+            }
+        }
+    }
+}
+
+/**
+ * Processes of the pipelines that run in the background, one vector per pipeline
+ */
+static std::vector<std::vector<pid_t>> backgroundJobs;
+
+/**
+ * Reaps the processes of background pipelines that have exited
+ * @return number of background pipelines that still have a running process
+ */
+size_t liveBackgroundJobs() {
+    for (auto job = backgroundJobs.begin(); job != backgroundJobs.end();) {
+        // Only the shell's own children are waited for, other children of a program that embeds it are left alone
+        job->erase(std::remove_if(job->begin(), job->end(), [](pid_t pid) {
+            return waitpid(pid, nullptr, WNOHANG) != 0;
+        }), job->end());
+        job = job->empty() ? backgroundJobs.erase(job) : job + 1;
+    }
+    return backgroundJobs.size();
+}
+
+/**
+ * Opens the output redirection of a command, truncating the file unless the redirection appends
+ * @return the file descriptor, -1 if the file can't be opened, an error has been printed then
+ */
+int openRedirOut(Command *command) {
+    int append = command->append ? O_APPEND : O_TRUNC;
+    int fd = open(command->redir_out, O_WRONLY | O_CREAT | O_CLOEXEC | append, S_IRUSR | S_IWUSR);
+    if (fd == -1) {
+        perror("open");
+    }
+    return fd;
+}
+
+/**
+ * Plans the command, wires it up and executes it. It also correctly redirects the first and last commands to stdin_fd
+ * and stdout_fd or file redirects. A cached pipeline whose key is in the store isn't executed at all, the output pump
+ * of one that isn't copies the output to a new cache entry as well. A cached pipeline without an input redirection
+ * always runs and isn't stored, its input isn't part of the key.
  * @param command the command to execute
+ * @param stdin_fd input of the first command when it has no input redirection
+ * @param stdout_fd where the output of the last command goes when it has no output redirection
+ * @param options options set by prefix builtins
+ * @return status and resource usage of all commands, only the status is set if command runs in the background
+ * @throws UnkownCommandException before anything is executed if one of the commands can't be found
  */
-void executeCommand(Command *command) {
+Shell::Result executeCommand(Command *command, int stdin_fd, int stdout_fd, const PipelineOptions &options) {
+    Shell::Result result = Shell::Result();
+    ExecutionPlan *plan = planCommand(command);
+    Command *last_command = lastCommand(command);
+    std::string cache_dir;
+    std::string cache_key;
+    std::string cache_path;
+    int cache_entry = -1;
+    if (options.cached && command->redir_in == nullptr) {
+        // Nothing identifies the content of an inherited STDIN, so the key can't cover it
+        cacheStats.misses++;
+    } else if (options.cached && !(cache_dir = cacheDir()).empty()) {
+        cache_key = cacheKey(plan, command, options.dependencies);
+        bool written;
+        if (serveCached(cache_dir, cache_key, last_command, stdout_fd, written)) {
+            delete plan;
+            result.status = written ? 0 : 1;
+            return result;
+        }
+        cache_entry = createCacheEntry(cache_dir, cache_path);
+    }
+    plan->own_group = options.timeout >= 0 || options.cancel != -1;
+    plan->perfstat = options.perfstat;
+    plan->stage_mask = options.stage_mask;
     int output;
-    char buf;
+    char buf[65536];
+    ssize_t got;
     int inputfile;
     if (command->redir_in != nullptr) {
-        inputfile = open(command->redir_in, O_RDONLY);
+        inputfile = open(command->redir_in, O_RDONLY | O_CLOEXEC);
         if (inputfile == -1) {
             perror("open");
-            return;
+            if (cache_entry != -1) {
+                close(cache_entry);
+                finishCacheEntry(cache_dir, cache_path, cache_key, false);
+            }
+            delete plan;
+            result.status = 1;
+            return result;
         }
-        output = executeCommand(command, inputfile);
     } else {
-        output = executeCommand(command, STDIN_FILENO);
+        inputfile = stdin_fd;
     }
+    if (!wirePlan(plan, inputfile)) {
+        closePlan(plan);
+        if (command->redir_in != nullptr)
+            close(inputfile);
+        if (cache_entry != -1) {
+            close(cache_entry);
+            finishCacheEntry(cache_dir, cache_path, cache_key, false);
+        }
+        delete plan;
+        result.status = 1;
+        return result;
+    }
+    output = executeCommand(plan);
 
-    Command *last_command = lastCommand(command);
+    Metrics &m = metrics();
     pid_t child = fork();
     if (child == 0) {
-        if (last_command->redir_out != nullptr) {
-            int append = last_command->append ? O_APPEND : O_TRUNC; // Truncate the file if not appending
-            int outputfile = open(last_command->redir_out, O_WRONLY | O_CREAT | append, S_IRUSR | S_IWUSR);
-            if (outputfile == -1) {
-                perror("open");
+        // Like the stages, the pump can be interrupted and hung up on
+        sigprocmask(SIG_SETMASK, options.stage_mask != nullptr ? options.stage_mask : &plan->sigmask, nullptr);
+        // The pump fails when the output of a cached pipeline couldn't be stored completely
+        int failed = 0;
+        int outputfile = last_command->redir_out != nullptr ? openRedirOut(last_command) : stdout_fd;
+        // Only the pipe, the output file and the cache entry stay open, on descriptors 3 to 5. They are first moved
+        // above those, so moving one doesn't overwrite another.
+        int *keep[3] = {&output, &outputfile, &cache_entry};
+        for (int *fd : keep) {
+            if (*fd != -1) {
+                *fd = fcntl(*fd, F_DUPFD_CLOEXEC, 10);
+            }
+        }
+        for (int i = 0; i < 3; i++) {
+            if (*keep[i] != -1) {
+                *keep[i] = dup2(*keep[i], 3 + i);
             } else {
-                while (read(output, &buf, 1) > 0)
-                    write(outputfile, &buf, 1);
+                close(3 + i);
             }
-        } else {
-            while (read(output, &buf, 1) > 0)
-                write(STDOUT_FILENO, &buf, 1);
         }
-        exit(0);
+        syscall(SYS_close_range, 6, ~0U, 0);
+        unsigned long long &pumped = last_command->redir_out != nullptr ? m.redirected_bytes : m.stdout_bytes;
+        while ((got = read(output, buf, sizeof(buf))) > 0) {
+            if (outputfile != -1 && writeAll(outputfile, buf, static_cast<size_t>(got)))
+                addMetric(pumped, static_cast<unsigned long long>(got));
+            if (cache_entry != -1 && !writeAll(cache_entry, buf, static_cast<size_t>(got)))
+                failed = 1;
+        }
+        _exit(failed);
     }
-    if (!command->bg) {
-        waitpid(child, NULL, 0);
-        // These file pointers also need to be closed when not waiting for the command to stop, however then we don't
-        // know when the command is stopped and the files can be closed, so this isn't done
-        if (command->redir_in != nullptr)
-            close(inputfile);
-        close(output);
+    // The stages and the pump have their own copies, the shell doesn't need these anymore
+    if (command->redir_in != nullptr)
+        close(inputfile);
+    close(output);
+    if (cache_entry != -1)
+        close(cache_entry);
+    if (child != -1)
+        addMetric(m.forks, 1);
+    else
+        perror("fork");
+    if (command->bg) {
+        sigprocmask(SIG_SETMASK, &plan->sigmask, nullptr);
+        std::vector<pid_t> pids;
+        for (Stage &stage : plan->stages) {
+            if (stage.pid > 0)
+                pids.push_back(stage.pid);
+        }
+        if (child != -1)
+            pids.push_back(child);
+        backgroundJobs.push_back(pids);
+    } else {
+        addMetric(m.foreground_jobs, 1);
+        result.signal = waitPlan(plan, options.timeout, options.cancel, result.rusage);
+        __atomic_fetch_sub(&m.foreground_jobs, 1, __ATOMIC_RELAXED);
+        result.status = pipelineStatus(plan);
+        if (plan->perfstat) {
+            printPerfStat(plan, std::cerr);
+            closeCounters(plan);
+        }
+        bool pumped = false;
+        if (child != -1) {
+            int pump_status;
+            waitpid(child, &pump_status, 0);
+            pumped = WIFEXITED(pump_status) && WEXITSTATUS(pump_status) == 0;
+        } else if (result.status == 0) {
+            // Without the pump the output went nowhere, even if the stages didn't notice
+            result.status = 1;
+        }
+        if (cache_entry != -1)
+            finishCacheEntry(cache_dir, cache_path, cache_key, result.status == 0 && result.signal == 0 && pumped);
     }
+    delete plan;
+    return result;
 }
 
 /**
@@ -497,11 +1222,10 @@ void executeCommand(Command *command) {
  */
 char *getDirName(char *dir) {
     char *home = getenv("HOME");
-    char *found = strnstr(dir, home, strlen(home));
-    if (found == nullptr) {
+    if (strncmp(dir, home, strlen(home)) != 0) {
         return dir;
     }
-    found = found + strlen(home) - 1;
+    char *found = dir + strlen(home) - 1;
     found[0] = '~';
     return found;
 }
@@ -527,43 +1251,286 @@ void displayPrompt() {
 
 /**
  * Show the prompt if showPrompt and get a command input line from stdin
+ *
+ * STDIN is read in blocks into a buffer that is kept for the next lines, like std::getline did. poll() only waits for
+ * STDIN and the metrics timer when the buffer holds no complete line, and only if SHELL_METRICS_FILE is set.
  * @param showPrompt
- * @return command input line
+ * @return command input line, empty at the end of the input
  */
 std::string requestCommandLine(bool showPrompt) {
     if (showPrompt)
         displayPrompt();
-    std::string retval;
-    getline(std::cin, retval);
+    static std::string buffered;
+    struct pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {metricsTimer(), POLLIN, 0}};
+    size_t newline;
+    while ((newline = buffered.find('\n')) == std::string::npos) {
+        if (fds[1].fd != -1) {
+            if (poll(fds, 2, -1) == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                perror("poll");
+                fds[1].fd = -1;
+            }
+            if (fds[1].revents & POLLIN) {
+                exportMetricsIfDue();
+            }
+            if (fds[1].fd != -1 && fds[0].revents == 0) {
+                continue;
+            }
+        }
+        char buf[4096];
+        ssize_t got = read(STDIN_FILENO, buf, sizeof(buf));
+        if (got == -1 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            std::string retval;
+            retval.swap(buffered);
+            return retval;
+        }
+        buffered.append(buf, static_cast<size_t>(got));
+    }
+    std::string retval = buffered.substr(0, newline);
+    buffered.erase(0, newline + 1);
     return retval;
 }
 
+/**
+ * Milliseconds watch-run waits for a burst of changes to end before it runs the pipeline again
+ */
+const int WATCH_DEBOUNCE = 100;
+
+/**
+ * Adds an inotify watch for every path. Files are watched themselves, so writes to other files next to them, like the
+ * output of the pipeline, don't count as changes. Editors that replace a file drop its watch, so this is called again
+ * before every run.
+ * @param fd inotify file descriptor
+ * @param paths files and directories to watch
+ */
+void addWatches(int fd, const std::vector<std::string> &paths) {
+    for (const std::string &path : paths) {
+        uint32_t mask = IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                        IN_DELETE_SELF | IN_MOVE_SELF;
+        if (inotify_add_watch(fd, path.c_str(), mask) == -1) {
+            std::cerr << "watch-run: " << path << ": " << strerror(errno) << std::endl;
+        }
+    }
+}
+
+/**
+ * Waits until the watched paths change, and then until no more changes arrive for WATCH_DEBOUNCE milliseconds
+ * @param inotify inotify file descriptor
+ * @param sigfd signalfd for the forwarded signals
+ * @return 0 when there were changes, the signal number if a signal arrived first, -1 on errors
+ */
+int waitForChanges(int inotify, int sigfd) {
+    struct pollfd fds[3] = {{inotify, POLLIN, 0}, {sigfd, POLLIN, 0}, {metricsTimer(), POLLIN, 0}};
+    int wait = -1;
+    for (;;) {
+        int ready = poll(fds, 3, wait);
+        if (ready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            return -1;
+        }
+        if (ready == 0) {
+            return 0;
+        }
+        if (fds[2].revents & POLLIN) {
+            exportMetricsIfDue();
+        }
+        if (fds[1].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            if (read(sigfd, &info, sizeof(info)) == sizeof(info)) {
+                return static_cast<int>(info.ssi_signo);
+            }
+        }
+        if (fds[0].revents & POLLIN) {
+            char events[4096];
+            while (read(inotify, events, sizeof(events)) > 0) {
+                // Only the fact that something changed matters
+            }
+            wait = WATCH_DEBOUNCE;
+        }
+    }
+}
+
+/**
+ * watch-run [paths...] -- pipeline
+ *
+ * Runs the pipeline, and runs it again whenever its input file or one of the paths changes. The line is parsed only
+ * once. Bursts of changes cause one run, and a change that arrives while the pipeline runs cancels that run: the
+ * inotify file descriptor is the cancel descriptor of waitPlan. Stops on SIGINT, SIGQUIT, SIGTERM or SIGHUP.
+ * @param command the parsed line, starting with watch-run
+ * @param stdin_fd input of the first command when it has no input redirection
+ * @param stdout_fd where the output of the last command goes when it has no output redirection
+ * @return result of the last run, status 128 + signal number if a signal stopped watch-run
+ */
+Shell::Result watchRun(Command *command, int stdin_fd, int stdout_fd) {
+    Shell::Result result = Shell::Result();
+    std::vector<std::string *> &args = *(command->args);
+    std::vector<std::string> paths;
+    size_t separator = 1;
+    for (; separator < args.size() && *args[separator] != "--"; separator++) {
+        paths.push_back(*args[separator]);
+    }
+    if (separator + 1 >= args.size() || command->bg) {
+        std::cerr << "watch-run: usage: watch-run [paths...] -- command" << std::endl;
+        result.status = 2;
+        return result;
+    }
+    args.erase(args.begin(), args.begin() + separator + 1);
+    command->command = args[0]->c_str();
+    if (command->redir_in != nullptr) {
+        paths.push_back(command->redir_in);
+    }
+    PipelineOptions options;
+    if (paths.empty()) {
+        std::cerr << "watch-run: nothing to watch" << std::endl;
+        result.status = 2;
+        return result;
+    }
+    if (!applyPrefixes(command, options)) {
+        result.status = 2;
+        return result;
+    }
+
+    // The forwarded signals stay blocked until watch-run is done, also between runs, where the signalfd picks them up.
+    // Unblocking them around the runs would let a signal that arrives right after a run kill the shell.
+    sigset_t forwarded = forwardedSignals();
+    sigset_t mask;
+    sigprocmask(SIG_BLOCK, &forwarded, &mask);
+    options.stage_mask = &mask;
+    int sigfd = signalfd(-1, &forwarded, SFD_NONBLOCK | SFD_CLOEXEC);
+    options.cancel = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (sigfd == -1 || options.cancel == -1) {
+        perror("watch-run");
+        result.status = 1;
+    } else {
+        for (;;) {
+            addWatches(options.cancel, paths);
+            try {
+                result = executeCommand(command, stdin_fd, stdout_fd, options);
+            } catch (UnkownCommandException &e) {
+                std::cerr << "shell: " << e.what() << std::endl;
+                result.status = 127;
+                break;
+            }
+            if (result.signal != 0) {
+                result.status = 128 + result.signal;
+                break;
+            }
+            int sig = waitForChanges(options.cancel, sigfd);
+            if (sig != 0) {
+                result.status = sig > 0 ? 128 + sig : 1;
+                result.signal = std::max(sig, 0);
+                break;
+            }
+        }
+    }
+    if (sigfd != -1) {
+        // waitPlan raised the signal that stopped the last run again, it is handled now
+        struct signalfd_siginfo info;
+        while (read(sigfd, &info, sizeof(info)) == sizeof(info)) {
+        }
+        close(sigfd);
+    }
+    if (options.cancel != -1) {
+        close(options.cancel);
+    }
+    sigprocmask(SIG_SETMASK, &mask, nullptr);
+    return result;
+}
+
+/**
+ * Parses and executes one command line, see Shell::run. The tokens and commands are deleted afterwards, services run
+ * lines for as long as they live.
+ */
+Shell::Result executeLine(const std::string &line, int stdin_fd, int stdout_fd) {
+    Shell::Result result = Shell::Result();
+    std::string commandLine = line;
+    std::vector<Token *> tokens = tokenList(commandLine);
+    if (tokens.empty()) {
+        return result;
+    }
+    Command *command = buildCommands(tokens);
+    if (command == nullptr) {
+        std::cerr << "Error in command syntax" << std::endl;
+        addMetric(metrics().parse_errors, 1);
+        result.status = 2;
+    } else {
+        result = executeCommands(command, stdin_fd, stdout_fd);
+        delete command;
+    }
+    for (Token *token : tokens) {
+        delete token;
+    }
+    return result;
+}
+
+/**
+ * Executes the parsed commands of a line
+ * @param command first command of the line
+ * @param stdin_fd input of the first command when it has no input redirection
+ * @param stdout_fd where the output of the last command goes when it has no output redirection
+ * @return status and resource usage of the line
+ */
+Shell::Result executeCommands(Command *command, int stdin_fd, int stdout_fd) {
+    Shell::Result result = Shell::Result();
+    if (strcmp(command->command, "watch-run") == 0) {
+        return watchRun(command, stdin_fd, stdout_fd);
+    }
+    PipelineOptions options;
+    if (!applyPrefixes(command, options)) {
+        result.status = 2;
+        return result;
+    }
+    if (executeBuiltin(command, stdout_fd, result)) {
+        return result;
+    }
+    try {
+        return executeCommand(command, stdin_fd, stdout_fd, options);
+    } catch (UnkownCommandException &e) {
+        std::cerr << "shell: " << e.what() << std::endl;
+        result.status = 127;
+    }
+    return result;
+}
+
+Shell::Result Shell::run(const std::string &line, int stdin_fd, int stdout_fd) {
+    long start = monotonicMicros();
+    liveBackgroundJobs(); // Reaps the background pipelines that are done
+    Result result = executeLine(line, stdin_fd, stdout_fd);
+    Metrics &m = metrics();
+    addMetric(m.lines, 1);
+    recordLatency(m.line_latency, monotonicMicros() - start);
+    exportMetricsIfDue();
+    return result;
+}
+
 /**
  * Main loop of the shell
  * @param showPrompt set to false if the prompt shouldn't be shown, only one command will be executed
- * @return 0
+ * @return status of the last command line
  */
 int shell(bool showPrompt) {
+    int status = 0;
+    if (metricsTimer() != -1) {
+        exportMetrics();
+    }
     do {
         std::string commandLine = requestCommandLine(showPrompt);
         if (commandLine == "") {
             continue;
         }
-        std::vector<Token *> tokens = tokenList(commandLine);
-        Command *command = buildCommands(tokens);
-        if (command == nullptr) {
-            std::cerr << "Error in command syntax" << std::endl;
-            continue;
-        }
-        if (executeBuiltin(command)) {
-            continue;
-        }
-        try {
-            executeCommand(command);
-        } catch (class UnkownCommandException &e) {
-            std::cerr << "shell: command not found\n" << std::endl;
+        Shell::Result result = Shell::run(commandLine, STDIN_FILENO, STDOUT_FILENO);
+        if (result.exit) {
             exit(0);
         }
+        status = result.status;
     } while (showPrompt);
-    return 0;
+    return status;
 }
@@ -0,0 +1,52 @@
+/**
+ * Public interface of the shell
+ *
+ * Services that want to run command lines without spawning /bin/sh link against shelllib and use Shell::run. The
+ * parser and executor building blocks are in shell_internal.h, which isn't meant for services.
+ */
+
+#ifndef SHELL_H
+#define SHELL_H
+
+#include <string>
+#include <sys/resource.h>
+
+namespace Shell {
+
+    /**
+     * Outcome of running a command line
+     * status: exit status of the last command that failed, like sh with pipefail reports it. 128 + signal number if
+     *         that command was killed by a signal. 2 when the line has a syntax error, 127 when a command can't be
+     *         found and 124 when a timeout expired
+     * rusage: resource usage of all commands of the line added together
+     * exit: set when the line was the exit builtin, the caller decides what to do with it
+     * signal: last signal the shell received while it waited for the line, 0 if none
+     */
+    struct Result {
+        int status;
+        struct rusage rusage;
+        bool exit;
+        int signal;
+    };
+
+    /**
+     * Parses and executes one command line in the calling process, without a prompt
+     *
+     * File redirections in the line take precedence over stdin_fd and stdout_fd. Relative paths are resolved against
+     * the current working directory. Unless the line ends with &, run returns after all commands have finished.
+     * Every line is counted in the metrics that the stats builtin prints.
+     *
+     * run changes state of the whole process: cd changes its working directory, and while commands run the
+     * forwarded signals SIGINT, SIGQUIT, SIGTERM and SIGHUP are blocked in its signal mask. The background jobs, the
+     * cache counters and the metrics timer are process wide as well. run must not be called from more than one thread
+     * at a time.
+     *
+     * @param line the command line
+     * @param stdin_fd file descriptor the first command reads from
+     * @param stdout_fd file descriptor the output of the last command is copied to
+     * @return status and resource usage of the line
+     */
+    Result run(const std::string &line, int stdin_fd, int stdout_fd);
+}
+
+#endif //SHELL_H
@@ -1,13 +1,23 @@
 #include <gtest/gtest.h>
+#include <algorithm>
+#include <dirent.h>
 #include <fcntl.h>
-#include "shell.cpp"
+#include <fstream>
+#include <ftw.h>
+#include <limits.h>
+#include <malloc.h>
+#include <sstream>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/utsname.h>
+#include <sys/wait.h>
+#include "shell_internal.h"
 
 using namespace std;
 
-// shell to run tests on
-#define SHELL "../cmake-build-debug/shell -t"
-//#define SHELL "/bin/sh"
-
 namespace {
 
     void Execute(std::string command, std::string expectedOutput);
@@ -15,6 +25,41 @@ namespace {
     void Execute(std::string command, std::string expectedOutput, std::string expectedOutputFile,
                  std::string expectedOutputFileContent);
 
+    std::string filecontents(const std::string &str);
+
+    void filewrite(const std::string &str, std::string content);
+
+    Shell::Result RunLine(const std::string &command);
+
+    /**
+     * Runs every test in its own temporary directory, so test processes can run in parallel
+     */
+    class ShellRun : public ::testing::Test {
+    protected:
+        char previous[512];
+        std::string dir;
+
+        void SetUp() override {
+            const char *tmp = getenv("TMPDIR");
+            std::string templ = std::string(tmp != nullptr ? tmp : "/tmp") + "/shelltest.XXXXXX";
+            ASSERT_NE(nullptr, getcwd(previous, sizeof(previous)));
+            ASSERT_NE(nullptr, mkdtemp(&templ[0]));
+            dir = templ;
+            ASSERT_EQ(0, chdir(dir.c_str()));
+            filewrite("1", "line 1\nline 2\nline 3\nline 4");
+            filewrite("2", "");
+            filewrite("3", "");
+            filewrite("4", "");
+        }
+
+        void TearDown() override {
+            ASSERT_EQ(0, chdir(previous));
+            nftw(dir.c_str(), [](const char *path, const struct stat *, int, struct FTW *) {
+                return remove(path);
+            }, 16, FTW_DEPTH | FTW_PHYS);
+        }
+    };
+
     TEST(Shell, BuildToken) {
         Token *expected = Token::make(TokenId::BG);
         std::string input = "&";
@@ -167,6 +212,158 @@ namespace {
         }
     }
 
+    TEST(Shell, parseDuration) {
+        EXPECT_EQ(5000, parseDuration("5"));
+        EXPECT_EQ(1500, parseDuration("1.5s"));
+        EXPECT_EQ(120000, parseDuration("2m"));
+        EXPECT_EQ(3600000, parseDuration("1h"));
+        EXPECT_EQ(86400000, parseDuration("1d"));
+        EXPECT_EQ(0, parseDuration("0"));
+        EXPECT_EQ(-1, parseDuration("-1"));
+        EXPECT_EQ(-1, parseDuration("5x"));
+        EXPECT_EQ(-1, parseDuration("5ss"));
+        EXPECT_EQ(-1, parseDuration("soon"));
+        EXPECT_EQ(-1, parseDuration("nan"));
+        EXPECT_EQ(LONG_MAX, parseDuration("inf"));
+        EXPECT_EQ(LONG_MAX, parseDuration("infd"));
+        EXPECT_EQ(LONG_MAX, parseDuration("1e30"));
+        EXPECT_EQ(LONG_MAX, parseDuration("1e400"));
+    }
+
+    TEST(Shell, resolveExecutable) {
+        EXPECT_EQ("/bin/sh", resolveExecutable("/bin/sh"));
+        EXPECT_NE("", resolveExecutable("sh"));
+        EXPECT_EQ("", resolveExecutable("/nonexistent/sh"));
+        EXPECT_EQ("", resolveExecutable("thiscommanddoesnotexist"));
+    }
+
+    TEST(Shell, planCommand) {
+        {
+            std::string input = "cat -u | head -n 3";
+            std::vector<Token *> tokens = tokenList(input);
+            ExecutionPlan *plan = planCommand(buildCommands(tokens));
+            ASSERT_EQ(2UL, plan->stages.size());
+            EXPECT_EQ(resolveExecutable("cat"), plan->stages[0].path);
+            EXPECT_EQ(2UL, arrlen(plan->stages[0].argv));
+            EXPECT_STREQ("cat", plan->stages[0].argv[0]);
+            EXPECT_STREQ("-u", plan->stages[0].argv[1]);
+            EXPECT_EQ(3UL, arrlen(plan->stages[1].argv));
+            EXPECT_STREQ("head", plan->stages[1].argv[0]);
+            EXPECT_STREQ("3", plan->stages[1].argv[2]);
+            // The argv for /bin/sh replaces the command with the shell and the path
+            EXPECT_EQ(3UL, arrlen(plan->stages[0].script_argv));
+            EXPECT_STREQ("/bin/sh", plan->stages[0].script_argv[0]);
+            EXPECT_EQ(plan->stages[0].path, plan->stages[0].script_argv[1]);
+            EXPECT_STREQ("-u", plan->stages[0].script_argv[2]);
+            // All argv arrays are in one block, right after each other
+            EXPECT_EQ(plan->stages[0].argv + 3, plan->stages[0].script_argv);
+            EXPECT_EQ(plan->stages[0].script_argv + 4, plan->stages[1].argv);
+
+            ASSERT_TRUE(wirePlan(plan, STDIN_FILENO));
+            EXPECT_EQ(STDIN_FILENO, plan->stages[0].in);
+            EXPECT_NE(-1, plan->stages[0].out);
+            EXPECT_NE(-1, plan->output);
+            closePlan(plan);
+            close(plan->output);
+            delete plan;
+        }
+        {
+            std::string input = "cat | thiscommanddoesnotexist | head";
+            std::vector<Token *> tokens = tokenList(input);
+            Command *command = buildCommands(tokens);
+            EXPECT_THROW(planCommand(command), UnkownCommandException);
+        }
+    }
+
+    TEST(Shell, countNewlines) {
+        std::string buf;
+        for (size_t i = 0; i < 9000; i++) {
+            buf += static_cast<char>(i * 7919 % 13 == 0 ? '\n' : 'a' + i % 26);
+        }
+        for (size_t len : {0UL, 1UL, 15UL, 16UL, 17UL, 33UL, 255UL * 32 + 5, buf.size()}) {
+            size_t expected = static_cast<size_t>(std::count(buf.begin(), buf.begin() + len, '\n'));
+            EXPECT_EQ(expected, countNewlines(buf.data(), len)) << len;
+
+            for (size_t nth : {1UL, 2UL, 17UL, expected, expected + 1}) {
+                size_t n = nth;
+                const char *found = findNewlines(buf.data(), len, n);
+                std::string::size_type pos = std::string::npos;
+                for (size_t i = 0, seen = 0; i < len; i++) {
+                    if (buf[i] == '\n' && ++seen == nth) {
+                        pos = i + 1;
+                        break;
+                    }
+                }
+                if (pos == std::string::npos) {
+                    EXPECT_EQ(nullptr, found) << len << " " << nth;
+                    EXPECT_EQ(nth - expected, n);
+                } else {
+                    EXPECT_EQ(buf.data() + pos, found) << len << " " << nth;
+                }
+
+                n = nth;
+                found = findNewlinesReverse(buf.data(), len, n);
+                pos = std::string::npos;
+                for (size_t i = len, seen = 0; i > 0; i--) {
+                    if (buf[i - 1] == '\n' && ++seen == nth) {
+                        pos = i - 1;
+                        break;
+                    }
+                }
+                if (pos == std::string::npos) {
+                    EXPECT_EQ(nullptr, found) << len << " " << nth;
+                    EXPECT_EQ(nth - expected, n);
+                } else {
+                    EXPECT_EQ(buf.data() + pos, found) << len << " " << nth;
+                }
+            }
+        }
+    }
+
+    TEST(Shell, nativeStage) {
+        const char *native[] = {"head", "head -n 3", "head -n3", "tail", "tail -n 0", "tail -n12", "wc -l"};
+        for (const char *line : native) {
+            std::string input = line;
+            std::vector<Token *> tokens = tokenList(input);
+            long count;
+            EXPECT_NE(nullptr, nativeStage(buildCommands(tokens), count)) << line;
+        }
+        const char *external[] = {"head 1", "head -n", "head -n -3", "head -c 3", "tail -n +3", "tail -f", "wc",
+                                  "wc -c", "/usr/bin/head -n 3", "cat"};
+        for (const char *line : external) {
+            std::string input = line;
+            std::vector<Token *> tokens = tokenList(input);
+            long count;
+            EXPECT_EQ(nullptr, nativeStage(buildCommands(tokens), count)) << line;
+        }
+    }
+
+    TEST(Shell, Sha256) {
+        Sha256 empty;
+        EXPECT_EQ("e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855", empty.hex());
+        Sha256 abc;
+        abc.update("abc", 3);
+        EXPECT_EQ("ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad", abc.hex());
+        // Chunks that don't line up with the 64 byte blocks
+        Sha256 million;
+        std::string chunk(1000, 'a');
+        for (int i = 0; i < 1000; i++) {
+            million.update(chunk.data(), chunk.size());
+        }
+        EXPECT_EQ("cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0", million.hex());
+    }
+
+    TEST(Shell, histogramIndex) {
+        for (unsigned long long value = 0; value < 100000; value++) {
+            size_t index = histogramIndex(value);
+            ASSERT_LE(value, histogramUpperBound(index)) << value;
+            ASSERT_TRUE(index == 0 || value > histogramUpperBound(index - 1)) << value;
+            // Buckets are at most 1/16 of their values wide
+            ASSERT_LE(histogramUpperBound(index) - value, value / HISTOGRAM_SUB_BUCKETS) << value;
+        }
+        EXPECT_EQ(HISTOGRAM_BUCKETS - 1, histogramIndex(~0ull));
+    }
+
     TEST(Shell, getDirName) {
         char buffer[512];
         char *home = getenv("HOME");
@@ -184,40 +381,426 @@ namespace {
         EXPECT_STREQ(expected, getDirName(buffer));
     }
 
-    TEST(Shell, ReadFromFile) {
+    TEST_F(ShellRun, ReadFromFile) {
         Execute("cat < 1", "line 1\nline 2\nline 3\nline 4");
     }
 
-    TEST(Shell, ReadFromAndWriteToFile) {
+    TEST_F(ShellRun, ReadFromAndWriteToFile) {
         Execute("cat < 1 > foobar", "", "foobar", "line 1\nline 2\nline 3\nline 4");
     }
 
-    TEST(Shell, ReadFromAndWriteToFileChained) {
+    TEST_F(ShellRun, ReadFromAndWriteToFileChained) {
         Execute("cat < 1 | head -n 3 > foobar", "", "foobar", "line 1\nline 2\nline 3\n");
         Execute("cat < 1 | head -n 3 | tail -n 1 > foobar", "", "foobar", "line 3\n");
     }
 
-    TEST(Shell, WriteToFile) {
+    TEST_F(ShellRun, WriteToFile) {
         Execute("ls -1 | head -n 4 > foobar", "", "foobar", "1\n2\n3\n4\n");
     }
 
-    TEST(Shell, Execute) {
-        Execute("uname", "Darwin\n"); // Works on my machine
+    TEST_F(ShellRun, Execute) {
+        struct utsname name;
+        uname(&name);
+        Execute("uname", std::string(name.sysname) + "\n");
         Execute("ls | head -n 4", "1\n2\n3\n4\n");
         Execute("ls -1 | head -n 4", "1\n2\n3\n4\n");
     }
 
-    TEST(Shell, ExecuteChained) {
+    TEST_F(ShellRun, ExecuteChained) {
         Execute("ls -1 | head -n 2", "1\n2\n");
         Execute("ls -1 | head -n 2 | tail -n 1", "2\n");
     }
 
-    // This test fails when running the test suite, but when testing >> manually it works completely
-//    TEST(Shell, AppendToFile) {
-//        Execute("echo hoi > foobar", "", "foobar", "hoi\n");
-//        Execute("cat foobar", "hoi\n");
-//        Execute("echo hai >> foobar", "", "foobar", "hoi\nhai");
-//    }
+    TEST_F(ShellRun, UnknownCommand) {
+        Execute("ls -1 | thiscommanddoesnotexist | head -n 2", "");
+    }
+
+    TEST_F(ShellRun, AppendToFile) {
+        Execute("echo hoi > foobar", "", "foobar", "hoi\n");
+        Execute("cat foobar", "hoi\n");
+        Execute("echo hai >> foobar", "", "foobar", "hoi\nhai\n");
+    }
+
+    TEST_F(ShellRun, Status) {
+        int devnull = open("/dev/null", O_RDWR);
+        EXPECT_EQ(0, Shell::run("true", devnull, devnull).status);
+        EXPECT_EQ(1, Shell::run("false", devnull, devnull).status);
+        EXPECT_EQ(1, Shell::run("false | true", devnull, devnull).status);
+        EXPECT_EQ(1, Shell::run("true | false", devnull, devnull).status);
+        EXPECT_EQ(2, Shell::run("ls nonexistent | true", devnull, devnull).status);
+        EXPECT_EQ(1, Shell::run("ls nonexistent | false | true", devnull, devnull).status);
+        EXPECT_EQ(2, Shell::run("| true", devnull, devnull).status);
+        EXPECT_EQ(127, Shell::run("thiscommanddoesnotexist", devnull, devnull).status);
+        EXPECT_EQ(1, Shell::run("cd thisdirdoesnotexist", devnull, devnull).status);
+        EXPECT_TRUE(Shell::run("exit", devnull, devnull).exit);
+        close(devnull);
+    }
+
+    TEST_F(ShellRun, CommandLinesFromStdin) {
+        // Like std::getline the shell reads ahead, cat gets no part of the next line
+        int input[2];
+        ASSERT_EQ(0, pipe(input));
+        std::string lines = "cat\necho hi\n";
+        ASSERT_EQ(static_cast<ssize_t>(lines.size()), write(input[1], lines.data(), lines.size()));
+        close(input[1]);
+        pid_t pid = fork();
+        if (pid == 0) {
+            int output = open("output", O_WRONLY | O_TRUNC | O_CREAT, S_IRUSR | S_IWUSR);
+            dup2(input[0], STDIN_FILENO);
+            dup2(output, STDOUT_FILENO);
+            shell(false);
+            _exit(shell(false));
+        }
+        close(input[0]);
+        int status;
+        ASSERT_EQ(pid, waitpid(pid, &status, 0));
+        ASSERT_TRUE(WIFEXITED(status));
+        EXPECT_EQ(0, WEXITSTATUS(status));
+        EXPECT_EQ("hi\n", filecontents("output"));
+    }
+
+    TEST_F(ShellRun, ScriptWithoutInterpreter) {
+        // execve() refuses it with ENOEXEC, like execvp the shell runs it with /bin/sh
+        filewrite("noshebang", "echo from-script \"$@\"\n");
+        chmod("noshebang", S_IRWXU);
+        Execute("./noshebang a b | cat", "from-script a b\n");
+    }
+
+    TEST_F(ShellRun, PerfStat) {
+        Execute("perfstat cat < 1 | head -n 1", "line 1\n");
+        EXPECT_EQ(2, RunLine("perfstat").status);
+        EXPECT_EQ(2, RunLine("perfstat cat &").status);
+
+        std::string input = "cat 1 | head -n 1";
+        std::vector<Token *> tokens = tokenList(input);
+        ExecutionPlan *plan = planCommand(buildCommands(tokens));
+        plan->perfstat = true;
+        int devnull = open("/dev/null", O_RDONLY);
+        ASSERT_TRUE(wirePlan(plan, devnull));
+        int output = executeCommand(plan);
+        char buf[64];
+        EXPECT_EQ(7, read(output, buf, sizeof(buf)));
+        struct rusage usage = {};
+        waitPlan(plan, -1, -1, usage);
+        EXPECT_EQ(0, pipelineStatus(plan));
+
+        std::stringstream table;
+        printPerfStat(plan, table);
+        closeCounters(plan);
+        std::string lines[4];
+        for (std::string &line : lines) {
+            std::getline(table, line);
+        }
+        EXPECT_EQ(0UL, lines[0].find("stage")) << table.str();
+        EXPECT_NE(std::string::npos, lines[0].find("cycles")) << table.str();
+        EXPECT_NE(std::string::npos, lines[0].find("page-faults")) << table.str();
+        EXPECT_EQ(0UL, lines[1].find("cat ")) << table.str();
+        EXPECT_EQ(0UL, lines[2].find("head ")) << table.str();
+        EXPECT_EQ(0UL, lines[3].find("total ")) << table.str();
+        close(output);
+        close(devnull);
+        delete plan;
+    }
+
+    TEST_F(ShellRun, RunDoesNotLeak) {
+        // The syntax errors would be printed thousands of times
+        int saved = dup(STDERR_FILENO);
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, STDERR_FILENO);
+        for (int i = 0; i < 100; i++) {
+            RunLine("cd . ");
+            RunLine("cd < 1 |");
+        }
+        long before = static_cast<long>(mallinfo2().uordblks);
+        for (int i = 0; i < 10000; i++) {
+            RunLine("cd . ");
+            RunLine("cd < 1 |");
+        }
+        long after = static_cast<long>(mallinfo2().uordblks);
+        dup2(saved, STDERR_FILENO);
+        close(saved);
+        close(devnull);
+        EXPECT_LT(after - before, 64 * 1024);
+    }
+
+    TEST_F(ShellRun, NativeStages) {
+        std::string lines;
+        for (int i = 0; i < 100000; i++) {
+            lines += std::string(static_cast<size_t>(i % 37), 'x') + std::to_string(i) + "\n";
+        }
+        filewrite("empty", "");
+        filewrite("nonewline", "a\nb\nc");
+        filewrite("newlines", "\n\n\n\n");
+        filewrite("lines", lines);
+        filewrite("unterminated", lines + "last");
+
+        const char *commands[] = {"head", "head -n 0", "head -n 3", "head -n3", "head -n 99999", "tail", "tail -n 0",
+                                  "tail -n 1", "tail -n 3", "tail -n 4", "tail -n 99999", "tail -n 200000", "wc -l"};
+        for (const char *file : {"empty", "nonewline", "newlines", "lines", "unterminated"}) {
+            for (std::string command : commands) {
+                std::string coreutils = resolveExecutable(command.substr(0, command.find(' ')).c_str()) +
+                                        command.substr(command.find(' ') == std::string::npos ? command.size()
+                                                                                              : command.find(' '));
+                // From a regular file and from a pipe
+                RunLine(coreutils + " < " + file);
+                std::string expected = filecontents("output");
+                EXPECT_EQ(0, RunLine(command + " < " + file).status);
+                EXPECT_EQ(expected, filecontents("output")) << command << " < " + std::string(file);
+                RunLine("cat < " + std::string(file) + " | " + command); // cat may get SIGPIPE
+                EXPECT_EQ(expected, filecontents("output")) << "cat | " << command << " < " + std::string(file);
+            }
+        }
+    }
+
+    TEST_F(ShellRun, NativeTailMemory) {
+        // One write per line, tail must not keep a read buffer per line
+        filewrite("lines.sh", "i=0\nwhile [ $i -lt 80000 ]; do echo line$i; i=$((i+1)); done\n");
+        Shell::Result result = RunLine("sh lines.sh | tail -n 80000");
+        EXPECT_EQ(0, result.status);
+        EXPECT_EQ(80000u, countNewlines(filecontents("output").data(), filecontents("output").size()));
+        EXPECT_LT(result.rusage.ru_maxrss, 64 * 1024); // In KiB
+    }
+
+    TEST_F(ShellRun, NativeHeadExitsEarly) {
+        struct timeval start, end;
+        gettimeofday(&start, nullptr);
+        Shell::Result result = RunLine("yes | head -n 1");
+        gettimeofday(&end, nullptr);
+        EXPECT_EQ(128 + SIGPIPE, result.status);
+        EXPECT_EQ("y\n", filecontents("output"));
+        EXPECT_LT(end.tv_sec - start.tv_sec, 2);
+    }
+
+    TEST_F(ShellRun, NoLeakedFileDescriptors) {
+        // RunLine's own /dev/null and output descriptors aren't close-on-exec, like those of an embedding program
+        Execute("cat < 1 | ls /proc/self/fd", "0\n1\n2\n3\n");
+        Execute("ls /proc/self/fd < 1", "0\n1\n2\n3\n");
+
+        // With STDIN closed the close-on-exec input file gets descriptor 0, the stage has to read it anyway
+        pid_t pid = fork();
+        if (pid == 0) {
+            int devnull = open("/dev/null", O_WRONLY);
+            close(STDIN_FILENO);
+            _exit(Shell::run("cat < 1 > out", STDIN_FILENO, devnull).status);
+        }
+        int status;
+        ASSERT_EQ(pid, waitpid(pid, &status, 0));
+        ASSERT_TRUE(WIFEXITED(status));
+        EXPECT_EQ(0, WEXITSTATUS(status));
+        EXPECT_EQ("line 1\nline 2\nline 3\nline 4", filecontents("out"));
+
+        // The output pump of a background job only keeps the pipe and the output file besides STDIN, STDOUT and
+        // STDERR. It is the child of this process that hasn't executed another program.
+        EXPECT_EQ(0, RunLine("sleep 0.3 > out &").status);
+        usleep(100000);
+        char self[PATH_MAX] = {};
+        ASSERT_NE(-1, readlink("/proc/self/exe", self, sizeof(self) - 1));
+        std::ifstream children("/proc/self/task/" + std::to_string(getpid()) + "/children");
+        int pumps = 0;
+        for (pid_t child; children >> child;) {
+            std::string proc = "/proc/" + std::to_string(child);
+            char exe[PATH_MAX] = {};
+            if (readlink((proc + "/exe").c_str(), exe, sizeof(exe) - 1) == -1 || strcmp(exe, self) != 0) {
+                continue;
+            }
+            pumps++;
+            DIR *fds = opendir((proc + "/fd").c_str());
+            ASSERT_NE(nullptr, fds);
+            std::vector<int> open;
+            while (struct dirent *ent = readdir(fds)) {
+                if (ent->d_name[0] != '.') {
+                    open.push_back(atoi(ent->d_name));
+                }
+            }
+            closedir(fds);
+            std::sort(open.begin(), open.end());
+            EXPECT_EQ(std::vector<int>({0, 1, 2, 3, 4}), open);
+        }
+        EXPECT_EQ(1, pumps);
+        for (int i = 0; i < 20 && liveBackgroundJobs() > 0; i++) {
+            usleep(100000);
+        }
+    }
+
+    TEST_F(ShellRun, ProducerStopsWhenConsumerExits) {
+        std::string input = "yes | " + resolveExecutable("head") + " -n 1 | sleep 2";
+        std::vector<Token *> tokens = tokenList(input);
+        ExecutionPlan *plan = planCommand(buildCommands(tokens));
+        int devnull = open("/dev/null", O_RDONLY);
+        ASSERT_TRUE(wirePlan(plan, devnull));
+        int output = executeCommand(plan);
+
+        // yes must be gone long before sleep is done
+        struct pollfd producer = {};
+        producer.fd = static_cast<int>(syscall(SYS_pidfd_open, plan->stages[0].pid, 0));
+        producer.events = POLLIN;
+        ASSERT_NE(-1, producer.fd);
+        EXPECT_EQ(1, poll(&producer, 1, 500));
+        close(producer.fd);
+
+        struct rusage usage = {};
+        waitPlan(plan, -1, -1, usage);
+        EXPECT_EQ(128 + SIGPIPE, plan->stages[0].status);
+        EXPECT_EQ(0, plan->stages[1].status);
+        close(output);
+        close(devnull);
+        delete plan;
+    }
+
+    TEST_F(ShellRun, Timeout) {
+        Execute("timeout 5 cat < 1 | head -n 1", "line 1\n");
+        EXPECT_EQ(2, RunLine("timeout 5").status);
+        EXPECT_EQ(2, RunLine("timeout soon cat").status);
+        EXPECT_EQ(2, RunLine("timeout 5 cat &").status);
+        // Longer than epoll_wait can wait at once
+        EXPECT_EQ(0, RunLine("timeout 30d true").status);
+        EXPECT_EQ(0, RunLine("timeout inf true").status);
+
+        struct timeval start, end;
+        gettimeofday(&start, nullptr);
+        Shell::Result result = RunLine("timeout 0.2 sleep 10 | cat");
+        gettimeofday(&end, nullptr);
+        EXPECT_EQ(124, result.status);
+        EXPECT_LT(end.tv_sec - start.tv_sec, 2);
+
+        // A stage that ignores SIGTERM is killed after a second
+        gettimeofday(&start, nullptr);
+        filewrite("ignoreterm", "trap '' TERM\nsleep 10\n");
+        result = RunLine("timeout 0.1 sh ignoreterm");
+        gettimeofday(&end, nullptr);
+        EXPECT_EQ(124, result.status);
+        EXPECT_LT(end.tv_sec - start.tv_sec, 3);
+    }
+
+    TEST_F(ShellRun, WatchRun) {
+        EXPECT_EQ(2, RunLine("watch-run 1").status);
+        EXPECT_EQ(2, RunLine("watch-run 1 --").status);
+        EXPECT_EQ(2, RunLine("watch-run -- cat").status);
+        EXPECT_EQ(2, RunLine("watch-run 1 -- cat &").status);
+        EXPECT_EQ(127, RunLine("watch-run 1 -- doesnotexist").status);
+
+        filewrite("data", "one\n");
+        filewrite("slow", "sleep 0.5\ncat\n");
+        pid_t pid = fork();
+        if (pid == 0) {
+            int devnull = open("/dev/null", O_RDWR);
+            _exit(Shell::run("watch-run -- sh slow < data >> log", devnull, devnull).status);
+        }
+        // Both changes arrive while the first run sleeps: it is cancelled and only the last content is run once
+        usleep(100000);
+        filewrite("data", "two\n");
+        usleep(20000);
+        filewrite("data", "three\n");
+        for (int i = 0; i < 50 && filecontents("log") != "three\n"; i++) {
+            usleep(100000);
+        }
+        EXPECT_EQ("three\n", filecontents("log"));
+
+        filewrite("data", "four\n");
+        for (int i = 0; i < 50 && filecontents("log") != "three\nfour\n"; i++) {
+            usleep(100000);
+        }
+        EXPECT_EQ("three\nfour\n", filecontents("log"));
+
+        kill(pid, SIGTERM);
+        int status;
+        ASSERT_EQ(pid, waitpid(pid, &status, 0));
+        ASSERT_TRUE(WIFEXITED(status));
+        EXPECT_EQ(128 + SIGTERM, WEXITSTATUS(status));
+    }
+
+    TEST_F(ShellRun, Cached) {
+        setenv("SHELL_CACHE_DIR", (dir + "/cache").c_str(), 1);
+        EXPECT_EQ(2, RunLine("cached cat").status);
+        EXPECT_EQ(2, RunLine("cached --").status);
+        EXPECT_EQ(2, RunLine("cached -- cat &").status);
+        EXPECT_EQ(127, RunLine("cached -- doesnotexist").status);
+
+        // The script leaves a trace of every run
+        filewrite("count", "echo run >> runs\ncat\n");
+        CacheStats before = cacheStats;
+        Execute("cached -- sh count < 1 > out", "", "out", "line 1\nline 2\nline 3\nline 4");
+        Execute("cached -- sh count < 1 > out", "", "out", "line 1\nline 2\nline 3\nline 4");
+        Execute("cached -- sh count < 1", "line 1\nline 2\nline 3\nline 4");
+        Execute("cached -- sh count < 1 >> out", "", "out",
+                "line 1\nline 2\nline 3\nline 4line 1\nline 2\nline 3\nline 4");
+        EXPECT_EQ("run\n", filecontents("runs"));
+        EXPECT_EQ(3ul, cacheStats.hits - before.hits);
+        EXPECT_EQ(1ul, cacheStats.misses - before.misses);
+
+        // A hit that can't write its output fails the line
+        EXPECT_EQ(1, RunLine("cached -- sh count < 1 > /dev/full").status);
+        EXPECT_EQ(1, RunLine("cached -- sh count < 1 > nonexistent/out").status);
+        EXPECT_EQ("run\n", filecontents("runs"));
+
+        // Changing the input or a dependency changes the key
+        filewrite("1", "other");
+        Execute("cached -- sh count < 1 > out", "", "out", "other");
+        Execute("cached count -- sh count < 1 > out", "", "out", "other");
+        filewrite("count", "echo run >> runs\ncat\n\n");
+        Execute("cached count -- sh count < 1 > out", "", "out", "other");
+        EXPECT_EQ("run\nrun\nrun\nrun\n", filecontents("runs"));
+
+        // Without an input file the pipeline reads STDIN, which isn't part of the key, so it always runs
+        filewrite("in1", "b\na\n");
+        filewrite("in2", "z\ny\n");
+        for (const char *in : {"in1", "in2"}) {
+            int input = open(in, O_RDONLY);
+            int output = open("out", O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+            EXPECT_EQ(0, Shell::run("cached -- sort", input, output).status);
+            close(input);
+            close(output);
+            EXPECT_EQ(in == std::string("in1") ? "a\nb\n" : "y\nz\n", filecontents("out"));
+        }
+
+        // Failing pipelines aren't stored
+        filewrite("fail", "echo partial\nexit 3\n");
+        EXPECT_EQ(3, RunLine("cached -- sh fail").status);
+        EXPECT_EQ(3, RunLine("cached -- sh fail").status);
+
+        // A store over its limit removes the entries that were used longest ago
+        setenv("SHELL_CACHE_SIZE", "8", 1);
+        evictCache(dir + "/cache", 8);
+        Execute("cached -- sh count < 1 > out", "", "out", "other");
+        Execute("cached -- sh count < 1 | head -n 1 > out", "", "out", "other");
+        EXPECT_EQ("run\nrun\nrun\nrun\nrun\nrun\n", filecontents("runs"));
+        EXPECT_EQ(0, RunLine("cache-stats > stats").status);
+        EXPECT_NE(std::string::npos, filecontents("stats").find("entries 1\n"));
+        EXPECT_NE(std::string::npos, filecontents("stats").find("limit 8\n"));
+        unsetenv("SHELL_CACHE_SIZE");
+        unsetenv("SHELL_CACHE_DIR");
+    }
+
+    TEST_F(ShellRun, Stats) {
+        Metrics before = metrics();
+        Execute("cat < 1 > out", "", "out", "line 1\nline 2\nline 3\nline 4");
+        EXPECT_EQ(2, RunLine("cat < 1 |").status);
+        EXPECT_EQ(127, RunLine("doesnotexist").status);
+        // execve() fails in the child for a file that is executable but whose interpreter doesn't exist
+        filewrite("notaprogram", "#!/nonexistent\n");
+        chmod("notaprogram", S_IRWXU);
+        EXPECT_EQ(127, RunLine("./notaprogram").status);
+        Metrics &after = metrics();
+        EXPECT_EQ(4ull, after.lines - before.lines);
+        EXPECT_EQ(1ull, after.parse_errors - before.parse_errors);
+        EXPECT_EQ(2ull, after.exec_failures - before.exec_failures);
+        EXPECT_EQ(4ull, after.forks - before.forks);
+        EXPECT_EQ(27ull, after.redirected_bytes - before.redirected_bytes);
+        EXPECT_EQ(4ull, after.line_latency.count - before.line_latency.count);
+        EXPECT_EQ(2ull, after.stage_latency.count - before.stage_latency.count);
+
+        EXPECT_EQ(0, RunLine("sleep 0.2 &").status);
+        EXPECT_EQ(1u, liveBackgroundJobs());
+        usleep(500000);
+        EXPECT_EQ(0u, liveBackgroundJobs());
+
+        EXPECT_EQ(0, RunLine("stats > stats").status);
+        std::string stats = filecontents("stats");
+        EXPECT_NE(std::string::npos, stats.find("\n# TYPE shell_lines_total counter\nshell_lines_total "));
+        EXPECT_NE(std::string::npos, stats.find("\nshell_live_jobs 0\n"));
+        EXPECT_NE(std::string::npos, stats.find("\n# TYPE shell_stage_duration_seconds histogram\n"));
+        EXPECT_NE(std::string::npos, stats.find("\nshell_line_duration_seconds_bucket{le=\"+Inf\"} "));
+    }
 
 
 //////////////// HELPERS
@@ -267,25 +850,33 @@ namespace {
         close(fd);
     }
 
+    /**
+     * Runs command with Shell::run, STDIN is /dev/null and STDOUT goes to the file output
+     */
+    Shell::Result RunLine(const std::string &command) {
+        int input = open("/dev/null", O_RDONLY);
+        int output = open("output", O_WRONLY | O_TRUNC | O_CREAT, S_IRUSR | S_IWUSR);
+        Shell::Result result = Shell::run(command, input, output);
+        close(input);
+        close(output);
+        return result;
+    }
+
     void Execute(std::string command, std::string expectedOutput) {
-        filewrite("input", command);
-        system(SHELL " < input > output 2> /dev/null");
+        RunLine(command);
         std::string got = filecontents("output");
         EXPECT_EQ(expectedOutput, got);
     }
 
     void Execute(std::string command, std::string expectedOutput, std::string expectedOutputFile,
                  std::string expectedOutputFileContent) {
-        std::string expectedOutputLocation = /*"../test-dir/" + */ expectedOutputFile;
-        unlink(expectedOutputLocation.c_str());
-        filewrite("input", command);
-        int rc = system(SHELL " < input > output 2> /dev/null");
-        EXPECT_EQ(0, rc);
+        std::string expectedOutputLocation = expectedOutputFile;
+        Shell::Result result = RunLine(command);
+        EXPECT_EQ(0, result.status);
         std::string got = filecontents("output");
         EXPECT_EQ(expectedOutput, got) << command;
         std::string gotOutputFileContents = filecontents(expectedOutputLocation);
         EXPECT_EQ(expectedOutputFileContent, gotOutputFileContents) << command;
-        //unlink(expectedOutputLocation.c_str());
     }
 
-}
\ No newline at end of file
+}
@@ -0,0 +1,484 @@
+/**
+ * Internals of the shell
+ *
+ * The parser, the executor and the native stages, cache and metrics share these types and functions. The test suite and
+ * the benchmark use them too. Services that embed the shell only need shell.h.
+ */
+
+#ifndef SHELL_INTERNAL_H
+#define SHELL_INTERNAL_H
+
+#include "shell.h"
+
+#include <exception>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * UnkownCommandException is thrown whenever a command is executed that can't be found
+ */
+class UnkownCommandException : public std::exception {
+    std::string message;
+
+public:
+    explicit UnkownCommandException(const char *command)
+            : message(std::string(command) + ": command not found") {}
+
+    const char *what() const noexcept override {
+        return message.c_str();
+    }
+};
+
+/**
+ * TokenId represents the token type found in the input string.
+ * IDENT: Identifier, a command or file for example
+ * PIPE: Literal pipe character
+ * REDIR_IN: Input redirection character (<)
+ * REDIR_OUT: Output redirection character (>)
+ * APPEND_OUT: Output redirection with append (>>)
+ * BG: Run as background character (&)
+ * END: End of the string
+ */
+enum TokenId {
+    IDENT,
+    PIPE,
+    REDIR_IN,
+    REDIR_OUT,
+    APPEND_OUT,
+    BG,
+    END,
+};
+
+/**
+ * Implementation of the Token type, supports a string value for identifiers.
+ */
+struct Token {
+private:
+    TokenId token_id;
+    std::string *str;
+
+    explicit Token(TokenId token_id_)
+            : token_id(token_id_), str(nullptr) {}
+
+    explicit Token(TokenId token_id_, const std::string &str_)
+            : token_id(token_id_), str(new std::string(str_)) {}
+
+    Token();
+
+public:
+    Token(const Token &) = delete;
+
+    Token &operator=(const Token &) = delete;
+
+    ~Token() {
+        delete str;
+    }
+
+    /**
+     * Convenience method for creating a non-identifier
+     * @param id The token to create
+     * @return A newly created Token struct
+     */
+    static Token *make(TokenId id) {
+        return new Token(id);
+    }
+
+    /**
+     * Convenience method for creating an identifier
+     * @param str The string to attach to the identifier
+     * @return A newly created Token struct
+     */
+    static Token *makeIdent(const std::string &str) {
+        return new Token(TokenId::IDENT, str);
+    }
+
+    bool operator==(const Token &rhs) const {
+        if (str == nullptr) {
+            return token_id == rhs.token_id && rhs.str == nullptr;
+        }
+        if (rhs.str == nullptr) {
+            return token_id == rhs.token_id;
+        }
+        return token_id == rhs.token_id &&
+               *str == *rhs.str;
+    }
+
+    bool operator!=(const Token &rhs) const {
+        return !(rhs == *this);
+    }
+
+    TokenId get_id() {
+        return this->token_id;
+    }
+
+    std::string *get_str() const {
+        return this->str;
+    }
+};
+
+bool strEqOrNull(const char *x, const char *y);
+
+/**
+ * Implementation of the Command struct
+ *
+ * Uses a recursive structure, if the commandline has multiple commands chained with pipes, the Command struct will
+ * have a child Command in pipe_to. planCommand walks this chain to build the stages of an ExecutionPlan.
+ *
+ * The command itself is stored in a char*, planCommand resolves it in PATH and copies it into the argv block of the
+ * plan that is passed to execve.
+ * The command arguments are stored in a vector so C++ methods can be used for simplicity.
+ * bg flag is set when the command is proceeded by an ampersand. This is ignored if the command isn't the last command.
+ * append flag is set when redir_out is an appending file redirection
+ * redir_in and redir_out are set to filenames when input and output redirection are used, otherwise they are NULL
+ */
+struct Command {
+    const char *command;
+    std::vector<std::string *> *args;
+    bool bg;
+    bool append;
+    const char *redir_in;
+    const char *redir_out;
+
+    Command *pipe_to;
+
+    /**
+     * Constructor for the empty command
+     */
+    explicit Command() : command(nullptr), args(nullptr), bg(false), append(false), redir_in(nullptr),
+                         redir_out(nullptr), pipe_to(nullptr) {}
+
+    Command(const Command &) = delete;
+
+    Command &operator=(const Command &) = delete;
+
+    /**
+     * Deletes the args vector and the rest of the chain. The strings belong to the tokens and stay.
+     */
+    ~Command() {
+        delete args;
+        delete pipe_to;
+    }
+
+    bool operator==(const Command &rhs) const {
+        if (!strEqOrNull(command, rhs.command)) {
+            return false;
+        }
+        if (!strEqOrNull(redir_in, rhs.redir_in)) {
+            return false;
+        }
+        if (!strEqOrNull(redir_out, rhs.redir_out)) {
+            return false;
+        }
+        if (bg != rhs.bg) {
+            return false;
+        }
+        if (append != rhs.append) {
+            return false;
+        }
+        if (args->size() != rhs.args->size()) {
+            return false;
+        }
+        for (size_t i = 0; i < args->size(); i++) {
+            if (*(*args)[i] != *(*rhs.args)[i]) {
+                return false;
+            }
+        }
+        if ((pipe_to == nullptr && rhs.pipe_to != nullptr) || (pipe_to != nullptr && rhs.pipe_to == nullptr)) {
+            return false;
+        }
+        if (pipe_to == nullptr && rhs.pipe_to == nullptr) {
+            return true;
+        }
+        return *pipe_to == *rhs.pipe_to;
+    }
+
+    bool operator!=(const Command &rhs) const {
+        return !(rhs == *this);
+    }
+};
+
+/**
+ * Options that prefix builtins such as timeout set for a whole pipeline
+ * timeout: milliseconds after which the pipeline is killed, -1 for no timeout
+ * perfstat: count hardware and software events per stage and print them when the pipeline is done
+ * cancel: file descriptor that becomes readable when the pipeline has to be killed, -1 for none
+ * cached: serve the output from the cache if the key of the pipeline is known, see cache.cpp
+ * dependencies: files besides the input file that the cache key depends on
+ * stage_mask: signal mask for the stages when the caller already blocks the forwarded signals, nullptr for the mask
+ *             of the shell
+ */
+struct PipelineOptions {
+    long timeout;
+    bool perfstat;
+    int cancel;
+    bool cached;
+    std::vector<std::string> dependencies;
+    const sigset_t *stage_mask;
+
+    explicit PipelineOptions() : timeout(-1), perfstat(false), cancel(-1), cached(false), stage_mask(nullptr) {}
+};
+
+/**
+ * Number of perf counters perfstat opens per stage: cycles, instructions, cache misses, context switches and page
+ * faults
+ */
+const size_t PERF_COUNTERS = 5;
+
+/**
+ * A stage the shell runs itself in the forked child instead of executing a program, see native.cpp. It gets the line
+ * count parsed from the arguments and returns the exit status.
+ */
+typedef int (*NativeStage)(long count);
+
+/**
+ * One process in an ExecutionPlan. path, argv and script_argv point into the plan's block, script_argv runs path with
+ * /bin/sh when execve() doesn't recognize it. in and out are the file descriptors the child has to dup2() onto STDIN
+ * and STDOUT. pidfd, status, reaped and usage are filled in by waitPlan. counters are the perf_event_open file
+ * descriptors of a perfstat pipeline, -1 when a counter isn't available. native is set for stages that don't execute a
+ * program, path is empty then. started is the monotonic time of the fork in microseconds.
+ */
+struct Stage {
+    const char *path;
+    char **argv;
+    char **script_argv;
+    int in;
+    int out;
+    pid_t pid;
+    int pidfd;
+    int status;
+    bool reaped;
+    struct rusage usage;
+    int counters[PERF_COUNTERS];
+    NativeStage native;
+    long count;
+    long started;
+
+    explicit Stage() : path(nullptr), argv(nullptr), script_argv(nullptr), in(-1), out(-1), pid(-1), pidfd(-1),
+                       status(0), reaped(false), usage(), native(nullptr), count(0), started(0) {
+        for (int &counter : counters) {
+            counter = -1;
+        }
+    }
+};
+
+/**
+ * Everything needed to run a chain of commands, prepared in the parent before anything is forked.
+ *
+ * All argv arrays and strings live in one contiguous block: first the pointer arrays of every stage (each NULL
+ * terminated, argv and script_argv of every stage), then /bin/sh, the resolved paths and argument strings. The
+ * children only have to dup2() and execve().
+ * output is the reading end of the last pipe, it is set by wirePlan.
+ * When own_group is set the stages get their own process group pgid, so they can be killed together. Otherwise they
+ * stay in the group of the shell and pgid is 0. sigmask is the signal mask of the shell from before the stages were
+ * forked, the children restore it before execve(), or stage_mask if that is set.
+ * When perfstat is set every child waits for a byte on the go pipe before execve(), so the shell can attach the perf
+ * counters first.
+ */
+struct ExecutionPlan {
+    std::vector<Stage> stages;
+    char *block;
+    int output;
+    bool own_group;
+    pid_t pgid;
+    sigset_t sigmask;
+    const sigset_t *stage_mask;
+    bool perfstat;
+    int go[2];
+
+    explicit ExecutionPlan() : block(nullptr), output(-1), own_group(false), pgid(0), stage_mask(nullptr),
+                               perfstat(false), go{-1, -1} {
+        sigemptyset(&sigmask);
+    }
+
+    ~ExecutionPlan() {
+        delete[] block;
+    }
+};
+
+/**
+ * Incremental SHA-256, the cached prefix uses it for the keys of its store. update(std::string) includes the
+ * terminating NUL, so consecutive fields can't run into each other. hex() finishes the hash.
+ */
+class Sha256 {
+    uint32_t state[8];
+    uint64_t length;
+    unsigned char buffer[64];
+    size_t used;
+
+    void block(const unsigned char *p);
+
+public:
+    Sha256();
+
+    void update(const void *data, size_t len);
+
+    void update(const std::string &str);
+
+    std::string hex();
+};
+
+/**
+ * Cache statistics of this shell process
+ * hits and misses: lookups by cached pipelines
+ * stores: outputs added to the store
+ * evictions: entries removed because the store was over its size limit
+ * bytes_served: output bytes written from the store
+ */
+struct CacheStats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long stores;
+    unsigned long evictions;
+    unsigned long long bytes_served;
+};
+
+extern CacheStats cacheStats;
+
+/**
+ * Histograms split every power of two range of microseconds in 2^HISTOGRAM_SUB_BITS buckets. HISTOGRAM_BUCKETS covers
+ * up to 2^41 microseconds, about 25 days, longer latencies are counted in the last bucket.
+ */
+const int HISTOGRAM_SUB_BITS = 4;
+const size_t HISTOGRAM_SUB_BUCKETS = 1 << HISTOGRAM_SUB_BITS;
+const size_t HISTOGRAM_BUCKETS = 38 * HISTOGRAM_SUB_BUCKETS;
+
+/**
+ * Latency histogram, see metrics.cpp. sum is in microseconds.
+ */
+struct Histogram {
+    unsigned long long buckets[HISTOGRAM_BUCKETS];
+    unsigned long long count;
+    unsigned long long sum;
+};
+
+/**
+ * Metrics of the shell and everything it forked, see metrics.cpp
+ * lines, parse_errors, builtins: command lines run by Shell::run, those with a syntax error, and builtins executed
+ * forks: stages and output pumps forked
+ * exec_failures: commands that couldn't be found, or that execve() failed for
+ * redirected_bytes, stdout_bytes: bytes the output pump wrote to an output redirection or to the output of the line
+ * foreground_jobs: pipelines the shell is waiting for
+ * line_latency, stage_latency: time from reading a line to its completion, and from fork to exit of every stage
+ */
+struct Metrics {
+    unsigned long long lines;
+    unsigned long long parse_errors;
+    unsigned long long builtins;
+    unsigned long long forks;
+    unsigned long long exec_failures;
+    unsigned long long redirected_bytes;
+    unsigned long long stdout_bytes;
+    unsigned long long foreground_jobs;
+    Histogram line_latency;
+    Histogram stage_latency;
+};
+
+Token *buildToken(std::string &input);
+
+size_t arrlen(char **array);
+
+std::vector<Token *> tokenList(std::string &commandLine);
+
+Command *buildCommands(std::vector<Token *> tokens);
+
+bool executeBuiltin(Command *command, int stdout_fd, Shell::Result &result);
+
+long parseDuration(const char *str);
+
+bool applyPrefixes(Command *command, PipelineOptions &options);
+
+std::string resolveExecutable(const char *name);
+
+ExecutionPlan *planCommand(Command *command);
+
+bool wirePlan(ExecutionPlan *plan, int input);
+
+void closePlan(ExecutionPlan *plan);
+
+int executeCommand(ExecutionPlan *plan);
+
+int waitPlan(ExecutionPlan *plan, long timeout, int cancel, struct rusage &usage);
+
+int pipelineStatus(ExecutionPlan *plan);
+
+void openCounters(Stage &stage);
+
+void printPerfStat(ExecutionPlan *plan, std::ostream &out);
+
+void closeCounters(ExecutionPlan *plan);
+
+Command *lastCommand(Command *pCommand);
+
+int openRedirOut(Command *command);
+
+Shell::Result executeCommand(Command *command, int stdin_fd, int stdout_fd, const PipelineOptions &options);
+
+Shell::Result watchRun(Command *command, int stdin_fd, int stdout_fd);
+
+Shell::Result executeLine(const std::string &line, int stdin_fd, int stdout_fd);
+
+Shell::Result executeCommands(Command *command, int stdin_fd, int stdout_fd);
+
+size_t liveBackgroundJobs();
+
+char *getDirName(char *dir);
+
+size_t countNewlines(const char *buf, size_t len);
+
+const char *findNewlines(const char *buf, size_t len, size_t &n);
+
+const char *findNewlinesReverse(const char *buf, size_t len, size_t &n);
+
+bool writeAll(int fd, const char *buf, size_t len);
+
+int nativeHead(long count);
+
+int nativeTail(long count);
+
+int nativeWc(long count);
+
+NativeStage nativeStage(Command *command, long &count);
+
+std::string cacheKey(ExecutionPlan *plan, Command *command, const std::vector<std::string> &dependencies);
+
+std::string cacheDir();
+
+off_t cacheLimit();
+
+bool serveCached(const std::string &dir, const std::string &key, Command *last, int stdout_fd, bool &written);
+
+int createCacheEntry(const std::string &dir, std::string &path);
+
+void evictCache(const std::string &dir, off_t limit);
+
+void finishCacheEntry(const std::string &dir, const std::string &path, const std::string &key, bool success);
+
+void printCacheStats(std::ostream &out);
+
+Metrics &metrics();
+
+void addMetric(unsigned long long &counter, unsigned long long value);
+
+long monotonicMicros();
+
+size_t histogramIndex(unsigned long long value);
+
+unsigned long long histogramUpperBound(size_t index);
+
+void recordLatency(Histogram &histogram, long micros);
+
+void printMetrics(std::ostream &out);
+
+int metricsTimer();
+
+void exportMetricsIfDue();
+
+void exportMetrics();
+
+int shell(bool showPrompt);
+
+#endif //SHELL_INTERNAL_H